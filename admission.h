@@ -0,0 +1,163 @@
+/* admission.h
+ * Admission control at the accept stage, shared by the server variants.
+ *
+ * Every connection is checked right after accept(). It is shed, with a
+ * canned 503 and Retry-After instead of being queued, when
+ *   - max_connections admitted connections are still open,
+ *   - max_queue accepted connections are already waiting for service, or
+ *   - the p99 from accept to first byte over the last ADMISSION_WINDOW_MS
+ *     is above max_latency_ms.
+ * Shedding the excess at the door keeps the queue short, so the latency
+ * of the connections that are admitted stays flat through a spike. Each
+ * limit is off while 0. The latency signal comes from the first_byte
+ * histograms of stats.h, so it needs stats_init().
+ *
+ * The state lives in a shared anonymous mapping, like stats.h, so the
+ * processes of the fork-based server share one connection count.
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "stats.h"
+
+#define ADMISSION_WINDOW_MS 500  // latency is judged over windows this long
+#define ADMISSION_RETRY_AFTER "1"  // seconds a shed client is asked to wait
+
+#define ADMISSION_USAGE \
+    "  -b backlog  listen() backlog (default: SOMAXCONN)\n" \
+    "  -c max      open connections before new ones are shed (default: no limit)\n" \
+    "  -q depth    connections waiting for service before new ones are shed (default: no limit)\n" \
+    "  -l ms       shed while the recent p99 from accept to first byte is above ms (default: off)\n"
+
+#define ADMISSION_BODY "Service Unavailable\n"
+#define ADMISSION_RESPONSE \
+    "HTTP/1.1 503 Service Unavailable\r\n" \
+    "Retry-After: " ADMISSION_RETRY_AFTER "\r\n" \
+    "Content-Type: text/plain\r\n" \
+    "Content-Length: 20\r\n" \
+    "Connection: close\r\n\r\n" \
+    ADMISSION_BODY
+
+typedef struct {
+    int backlog;
+    int max_connections;
+    int max_queue;
+    int max_latency_ms;
+    int active;               // admitted connections not yet done
+    uint64_t checked;         // stats_now() of the last latency check
+    int overloaded;           // the last window's p99 was above max_latency_ms
+    stats_histogram seen;     // first_byte totals at the last check
+} admission_control;
+
+static admission_control *admission;
+
+/* Parses the admission options (see ADMISSION_USAGE) and sets up the shared
+ * state. Returns the index of the first argument that is not an option, or
+ * -1 on a bad option or when the mapping fails. */
+static inline int admission_init(int argc, char *argv[]) {
+    void *p = mmap(NULL, sizeof(admission_control), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("ERROR mapping admission state");
+        return -1;
+    }
+    admission = p;
+    admission->backlog = SOMAXCONN;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:c:q:l:")) != -1) {
+        switch (opt) {
+        case 'b': admission->backlog = atoi(optarg); break;
+        case 'c': admission->max_connections = atoi(optarg); break;
+        case 'q': admission->max_queue = atoi(optarg); break;
+        case 'l': admission->max_latency_ms = atoi(optarg); break;
+        default: return -1;
+        }
+    }
+    if (admission->backlog <= 0) {
+        admission->backlog = SOMAXCONN;
+    }
+    return optind;
+}
+
+// Connections accepted by the kernel that nobody has accept()ed yet.
+static inline int admission_listen_queue(int listen_fd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(listen_fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return 0;
+    }
+    return info.tcpi_unacked;  // the accept queue length, for a listening socket
+}
+
+// Whether the recent p99 to first byte is above the limit. One caller per
+// window adds up the histograms; the others use its verdict.
+static inline int admission_overloaded(void) {
+    if (admission->max_latency_ms == 0) {
+        return 0;
+    }
+    uint64_t now = stats_now();
+    uint64_t checked = __atomic_load_n(&admission->checked, __ATOMIC_RELAXED);
+    if (now - checked >= ADMISSION_WINDOW_MS * 1000000ull &&
+        __atomic_compare_exchange_n(&admission->checked, &checked, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        stats_histogram total, recent;
+        memset(&total, 0, sizeof(total));
+        stats_stage_total(STATS_FIRST_BYTE, &total);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            recent.counts[b] = total.counts[b] - admission->seen.counts[b];
+        }
+        recent.total = total.total - admission->seen.total;
+        recent.max = total.max;
+        admission->seen = total;
+        int overloaded = recent.total > 0 &&
+                         stats_percentile(&recent, 99) > admission->max_latency_ms * 1000000ull;
+        __atomic_store_n(&admission->overloaded, overloaded, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&admission->overloaded, __ATOMIC_RELAXED);
+}
+
+/* Decides on a connection just accepted from listen_fd; queued counts
+ * connections waiting for service ahead of it besides the kernel's accept
+ * queue. Returns 1 once the connection is admitted, to be given back with
+ * admission_done(), or 0 when it is to be shed with admission_reject(). */
+static inline int admission_admit(int listen_fd, int queued) {
+    if (admission->max_queue > 0 && queued + admission_listen_queue(listen_fd) >= admission->max_queue) {
+        return 0;
+    }
+    if (admission_overloaded()) {
+        return 0;
+    }
+    int active = __atomic_add_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+    if (admission->max_connections > 0 && active > admission->max_connections) {
+        __atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static inline void admission_done(void) {
+    __atomic_sub_fetch(&admission->active, 1, __ATOMIC_RELAXED);
+}
+
+/* Sheds a connection without ever blocking: the request head that has
+ * already arrived is read and dropped, so closing does not reset the
+ * connection under the 503, which is then written and the socket closed. */
+static inline void admission_reject(int fd) {
+    char scratch[2048];
+    recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT);  // nothing may have arrived yet; fine
+    send(fd, ADMISSION_RESPONSE, sizeof(ADMISSION_RESPONSE) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    stats_count(STATS_SHED);
+    stats_status("503 Service Unavailable");
+    close(fd);
+}
+
+#endif
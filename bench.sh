@@ -0,0 +1,68 @@
+#!/bin/sh
+# bench.sh
+# Builds the server variants and loadgen, then runs the same workloads
+# against each server over loopback and prints one comparison table.
+#
+# The request mix is every file under arquivos/. server.c is left out: it
+# answers every request with a fixed page and is not a file server.
+#
+# Usage: ./bench.sh [seconds]
+# Environment: CONNECTIONS (default 50), THREADS (loadgen threads, default 2),
+#              RATE (requests/s for the open-loop run, default 2000),
+#              PORT (first port to use, default 18080), CC (default gcc)
+
+set -e
+
+DURATION=${1:-10}
+CONNECTIONS=${CONNECTIONS:-50}
+THREADS=${THREADS:-2}
+RATE=${RATE:-2000}
+PORT=${PORT:-18080}
+CC=${CC:-gcc}
+
+cd "$(dirname "$0")"
+BUILD=$(mktemp -d)
+trap 'kill $SERVER 2>/dev/null; rm -rf "$BUILD"' EXIT INT TERM
+
+for prog in server1 server2 server3 server4 server5 loadgen; do
+    $CC -O2 -pthread -o "$BUILD/$prog" "$prog.c"
+done
+
+PATHS=$(cd arquivos && find . -type f | sed 's|^\.||')
+
+# Waits until something accepts connections on $1
+wait_for_port() {
+    for _ in 1 2 3 4 5 6 7 8 9 10; do
+        if "$BUILD/loadgen" -t 1 -c 1 -d 1 -s 127.0.0.1 "$1" >/dev/null 2>&1; then
+            return 0
+        fi
+        sleep 0.2
+    done
+    echo "server on port $1 did not start" >&2
+    return 1
+}
+
+printf '%-10s %-16s %10s %9s %9s %9s %9s %7s\n' \
+    server workload req/s p50_us p99_us p999_us max_us errors
+
+for server in server1 server2 server3 server4 server5; do
+    PORT=$((PORT + 1))
+    "$BUILD/$server" "$PORT" arquivos >/dev/null 2>&1 &
+    SERVER=$!
+    wait_for_port "$PORT"
+
+    for workload in close keep-alive open-loop; do
+        case $workload in
+            close)      flags="" ;;
+            keep-alive) flags="-k" ;;
+            open-loop)  flags="-k -r $RATE" ;;
+        esac
+        # shellcheck disable=SC2086
+        set -- $("$BUILD/loadgen" -s -t "$THREADS" -c "$CONNECTIONS" -d "$DURATION" $flags \
+                 127.0.0.1 "$PORT" $PATHS)
+        printf '%-10s %-16s %10s %9s %9s %9s %9s %7s\n' "$server" "$workload" "$@"
+    done
+
+    kill "$SERVER"
+    wait "$SERVER" 2>/dev/null || true
+done
@@ -0,0 +1,133 @@
+/* bench_queue.c
+ * Compares the lock-free ring from mpmc_ring.h with the mutex/condvar linked
+ * list TaskQueue that server3.c used before, moving client sockets from
+ * producer threads to consumer threads.
+ *
+ * Usage: bench_queue [producers] [consumers] [items]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mpmc_ring.h"
+
+// The previous server3.c queue, kept here as the baseline
+typedef struct Task {
+    int client_socket;
+    struct Task* next;
+} Task;
+
+typedef struct {
+    Task* front;
+    Task* rear;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} TaskQueue;
+
+static void list_init(TaskQueue* queue) {
+    queue->front = queue->rear = NULL;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+}
+
+static void list_enqueue(TaskQueue* queue, int client_socket) {
+    Task* newTask = (Task*)malloc(sizeof(Task));
+    newTask->client_socket = client_socket;
+    newTask->next = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->rear == NULL) {
+        queue->front = queue->rear = newTask;
+    } else {
+        queue->rear->next = newTask;
+        queue->rear = newTask;
+    }
+    pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static int list_dequeue(TaskQueue* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->front == NULL) {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+    Task* temp = queue->front;
+    int client_socket = temp->client_socket;
+    queue->front = queue->front->next;
+    if (queue->front == NULL) {
+        queue->rear = NULL;
+    }
+    free(temp);
+    pthread_mutex_unlock(&queue->mutex);
+    return client_socket;
+}
+
+typedef struct {
+    int use_ring;
+    TaskQueue list;
+    mpmc_ring ring;
+    long per_producer;
+    long per_consumer;
+} Bench;
+
+static void* producer(void* arg) {
+    Bench* b = arg;
+    for (long i = 0; i < b->per_producer; i++) {
+        if (b->use_ring) ring_push(&b->ring, (ring_conn){ (int)i, 0 }); else list_enqueue(&b->list, (int)i);
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    Bench* b = arg;
+    long sum = 0;
+    for (long i = 0; i < b->per_consumer; i++) {
+        sum += b->use_ring ? ring_pop(&b->ring).fd : list_dequeue(&b->list);
+    }
+    return (void*)sum;
+}
+
+static double run(Bench* b, int producers, int consumers) {
+    pthread_t threads[producers + consumers];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < consumers; i++) {
+        pthread_create(&threads[i], NULL, consumer, b);
+    }
+    for (int i = 0; i < producers; i++) {
+        pthread_create(&threads[consumers + i], NULL, producer, b);
+    }
+    for (int i = 0; i < producers + consumers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    int producers = argc > 1 ? atoi(argv[1]) : 1;
+    int consumers = argc > 2 ? atoi(argv[2]) : 4;
+    long items = argc > 3 ? atol(argv[3]) : 2000000;
+
+    // Round so every thread moves the same number of items
+    items -= items % ((long)producers * consumers);
+    Bench b;
+    b.per_producer = items / producers;
+    b.per_consumer = items / consumers;
+
+    printf("%d producer(s), %d consumer(s), %ld items\n", producers, consumers, items);
+
+    b.use_ring = 0;
+    list_init(&b.list);
+    double elapsed = run(&b, producers, consumers);
+    printf("%-28s %12.0f items/s\n", "mutex + condvar list", items / elapsed);
+
+    b.use_ring = 1;
+    if (ring_init(&b.ring, 256) < 0) {
+        perror("ring_init");
+        return 1;
+    }
+    elapsed = run(&b, producers, consumers);
+    printf("%-28s %12.0f items/s\n", "lock-free ring (256 slots)", items / elapsed);
+    return 0;
+}
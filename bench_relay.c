@@ -0,0 +1,197 @@
+/* bench_relay.c
+ * Measures broadcast throughput of the select.c relay: senders write bursts
+ * of messages, every other client receives them, and the rate at which
+ * messages reach receivers is reported.
+ *
+ * All clients run on one thread over epoll. Senders stay at most WINDOW
+ * messages ahead of the slowest receiver, so the relay never has to drop
+ * anyone for lagging. With -f messages go out as length-prefixed frames,
+ * for a relay started with -f; without it they are plain bytes, which the
+ * relay forwards however its reads happen to split them.
+ *
+ * Usage: bench_relay [-f] [-r receivers] [-s senders] [-n messages] [-b burst] [-m size] host port
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define WINDOW 1024  // messages senders may be ahead of the slowest receiver
+#define MAX_EVENTS 256
+
+typedef struct {
+    int fd;
+    int sender;
+    uint64_t received;  // bytes
+} peer;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_to(struct addrinfo *addr) {
+    int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Writes all of len bytes to a non-blocking socket, waiting for room
+static int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int framed = 0, receivers = 100, senders = 4, burst = 16, size = 64;
+    long messages = 100000;
+    int opt;
+    while ((opt = getopt(argc, argv, "fr:s:n:b:m:")) != -1) {
+        switch (opt) {
+        case 'f': framed = 1; break;
+        case 'r': receivers = atoi(optarg); break;
+        case 's': senders = atoi(optarg); break;
+        case 'n': messages = atol(optarg); break;
+        case 'b': burst = atoi(optarg); break;
+        case 'm': size = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [-r receivers] [-s senders] [-n messages] [-b burst] [-m size] host port\n", argv[0]);
+            return 1;
+        }
+    }
+    if (argc - optind < 2 || receivers < 1 || senders < 1 || burst < 1 || size < 1) {
+        fprintf(stderr, "Usage: %s [-f] [-r receivers] [-s senders] [-n messages] [-b burst] [-m size] host port\n", argv[0]);
+        return 1;
+    }
+    if (burst > WINDOW) {
+        burst = WINDOW;
+    }
+    messages -= messages % ((long)senders * burst);
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(argv[optind], argv[optind + 1], &hints, &addr);
+    if (rc != 0) {
+        fprintf(stderr, "ERROR resolving %s: %s\n", argv[optind], gai_strerror(rc));
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int npeers = receivers + senders;
+    peer *peers = calloc(npeers, sizeof(peer));
+    for (int i = 0; i < npeers; i++) {
+        if ((peers[i].fd = connect_to(addr)) < 0) {
+            perror("ERROR connecting");
+            return 1;
+        }
+        peers[i].sender = i >= receivers;
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &peers[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peers[i].fd, &ev);
+    }
+    freeaddrinfo(addr);
+    usleep(200000);  // let the relay accept everyone before the first message
+
+    // One burst: burst messages of size bytes, framed or not
+    size_t message_len = (framed ? 4 : 0) + size;
+    char *block = malloc(message_len * burst);
+    for (int i = 0; i < burst; i++) {
+        char *m = block + i * message_len;
+        if (framed) {
+            m[0] = size >> 24; m[1] = size >> 16; m[2] = size >> 8; m[3] = size;
+            m += 4;
+        }
+        memset(m, 'a' + i % 26, size);
+    }
+
+    // Every receiver gets every message; so does every sender, but its own
+    uint64_t expected = messages * message_len;
+    long sent = 0;
+    int turn = 0;
+    double start = now_seconds();
+    char buf[1 << 16];
+    while (1) {
+        uint64_t slowest = UINT64_MAX;
+        for (int i = 0; i < receivers; i++) {
+            if (peers[i].received < slowest) {
+                slowest = peers[i].received;
+            }
+        }
+        if (slowest == expected) {
+            break;
+        }
+        if (sent < messages && sent - (long)(slowest / message_len) + burst <= WINDOW) {
+            if (write_all(peers[receivers + turn].fd, block, message_len * burst) < 0) {
+                perror("ERROR sending");
+                return 1;
+            }
+            sent += burst;
+            turn = (turn + 1) % senders;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, sent < messages ? 0 : 5000);
+        if (n == 0 && sent == messages) {
+            fprintf(stderr, "ERROR stalled with %llu of %llu bytes at the slowest receiver\n",
+                    (unsigned long long)slowest, (unsigned long long)expected);
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            peer *p = events[i].data.ptr;
+            ssize_t got = recv(p->fd, buf, sizeof(buf), MSG_DONTWAIT);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                fprintf(stderr, "ERROR the relay dropped a %s\n", p->sender ? "sender" : "receiver");
+                return 1;
+            }
+            if (got > 0) {
+                p->received += got;
+            }
+        }
+    }
+    double elapsed = now_seconds() - start;
+
+    uint64_t delivered = (uint64_t)messages * receivers;
+    printf("%d receivers, %d senders, %ld messages of %d bytes in bursts of %d%s\n",
+           receivers, senders, messages, size, burst, framed ? ", framed" : "");
+    printf("%.3f s, %.0f messages/s sent, %.0f messages/s delivered to receivers\n",
+           elapsed, messages / elapsed, delivered / elapsed);
+    return 0;
+}
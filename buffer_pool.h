@@ -0,0 +1,122 @@
+/* buffer_pool.h
+ * Per-thread allocators for the event loop in server4.c.
+ *
+ * A slab_pool hands out fixed-size objects (connections, response buffers)
+ * carved from slabs of many objects at a time and recycled through a free
+ * list, so once the pool has grown to the working set, connection churn
+ * never reaches malloc. Pools take no locks: each one belongs to a single
+ * reactor thread.
+ *
+ * An arena is a bump allocator over one block from a pool. Everything a
+ * response needs is allocated from its arena and dropped in bulk with
+ * arena_reset() once the response is sent. A response that outgrows the
+ * block spills into malloc'ed blocks, which the reset frees.
+ */
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#define POOL_ALIGN 16  // every object and arena allocation is aligned to this
+
+typedef struct slab_object {
+    struct slab_object *next;
+} slab_object;
+
+typedef struct {
+    size_t object_size;
+    size_t per_slab;       // objects carved from each malloc'ed slab
+    slab_object *free_list;
+    size_t objects;        // objects carved so far
+    size_t in_use;
+} slab_pool;
+
+static inline size_t pool_align(size_t n) {
+    return (n + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+}
+
+static inline void slab_pool_init(slab_pool *pool, size_t object_size, size_t per_slab) {
+    pool->object_size = pool_align(object_size < sizeof(slab_object) ? sizeof(slab_object) : object_size);
+    pool->per_slab = per_slab > 0 ? per_slab : 1;
+    pool->free_list = NULL;
+    pool->objects = 0;
+    pool->in_use = 0;
+}
+
+/* Returns an uninitialised object, or NULL when a new slab cannot be
+ * allocated. Slabs are never returned to the system; the pool keeps its
+ * high-water mark. */
+static inline void *slab_alloc(slab_pool *pool) {
+    if (pool->free_list == NULL) {
+        char *slab = aligned_alloc(POOL_ALIGN, pool->object_size * pool->per_slab);
+        if (slab == NULL) {
+            return NULL;
+        }
+        for (size_t i = pool->per_slab; i-- > 0; ) {
+            slab_object *obj = (slab_object *)(slab + i * pool->object_size);
+            obj->next = pool->free_list;
+            pool->free_list = obj;
+        }
+        pool->objects += pool->per_slab;
+    }
+    slab_object *obj = pool->free_list;
+    pool->free_list = obj->next;
+    pool->in_use++;
+    return obj;
+}
+
+static inline void slab_free(slab_pool *pool, void *ptr) {
+    slab_object *obj = ptr;
+    obj->next = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
+
+typedef struct arena_spill {
+    struct arena_spill *next;
+} arena_spill;
+
+typedef struct {
+    char *base;          // block from a slab_pool, or NULL when unused
+    size_t size;
+    size_t used;
+    arena_spill *spill;  // malloc'ed blocks for allocations that did not fit
+} arena;
+
+static inline void arena_init(arena *a, void *base, size_t size) {
+    a->base = base;
+    a->size = size;
+    a->used = 0;
+    a->spill = NULL;
+}
+
+/* Returns size bytes that stay valid until the next arena_reset(), or NULL
+ * when memory runs out. */
+static inline void *arena_alloc(arena *a, size_t size) {
+    size = pool_align(size);
+    if (a->base != NULL && a->size - a->used >= size) {
+        void *p = a->base + a->used;
+        a->used += size;
+        return p;
+    }
+    arena_spill *block = malloc(pool_align(sizeof(arena_spill)) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = a->spill;
+    a->spill = block;
+    return (char *)block + pool_align(sizeof(arena_spill));
+}
+
+// Frees everything allocated since the last reset. The block is kept.
+static inline void arena_reset(arena *a) {
+    while (a->spill != NULL) {
+        arena_spill *next = a->spill->next;
+        free(a->spill);
+        a->spill = next;
+    }
+    a->used = 0;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/* conditional.h
+ * Validators and conditional requests.
+ *
+ * Responses carry an ETag made from the file's size and modification time
+ * plus a Last-Modified date. A request whose If-None-Match lists the current
+ * ETag, or, without If-None-Match, whose If-Modified-Since is not older than
+ * the file, is answered with 304 Not Modified and no body. If-Range decides
+ * whether a Range header applies. Everything is derived from stat() data, so
+ * the servers can decide from cached metadata without opening the file.
+ */
+#ifndef CONDITIONAL_H
+#define CONDITIONAL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "http_parser.h"
+#include "response.h"
+#include "content_encoding.h"
+
+#define ETAG_SIZE 48
+#define HTTP_DATE_SIZE 32  // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+typedef struct {
+    char etag[ETAG_SIZE];                // quoted, as sent
+    char last_modified[HTTP_DATE_SIZE];
+    time_t mtime;
+} http_validators;
+
+/* Fills v for a representation of a file. encoding names the
+ * Content-Encoding of a compressed variant (NULL for the plain file) so
+ * each variant gets an ETag of its own. */
+static inline void http_validators_init(http_validators *v, const struct timespec *mtime, off_t size,
+                                        const char *encoding) {
+    unsigned long long ns = (unsigned long long)mtime->tv_sec * 1000000000ull + mtime->tv_nsec;
+    snprintf(v->etag, sizeof(v->etag), "\"%llx-%llx%s%s\"", (unsigned long long)size, ns,
+             encoding != NULL ? "-" : "", encoding != NULL ? encoding : "");
+    struct tm tm;
+    gmtime_r(&mtime->tv_sec, &tm);
+    strftime(v->last_modified, sizeof(v->last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    v->mtime = mtime->tv_sec;
+}
+
+// Parses n decimal digits. Returns -1 if any of them is not a digit.
+static inline int http_date_digits(const char *p, int n) {
+    int value = 0;
+    for (int i = 0; i < n; i++) {
+        if (p[i] < '0' || p[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (p[i] - '0');
+    }
+    return value;
+}
+
+/* Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 for
+ * anything else; the obsolete formats are treated as invalid, which makes
+ * the condition be ignored. */
+static inline time_t http_parse_date(const char *p, size_t len) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    if (len != 29 || p[3] != ',' || p[4] != ' ' || p[7] != ' ' || p[11] != ' ' || p[16] != ' ' ||
+        p[19] != ':' || p[22] != ':' || memcmp(p + 25, " GMT", 4) != 0) {
+        return -1;
+    }
+    int mon = 0;
+    while (mon < 12 && memcmp(months + 3 * mon, p + 8, 3) != 0) {
+        mon++;
+    }
+    int day = http_date_digits(p + 5, 2), year = http_date_digits(p + 12, 4);
+    int hour = http_date_digits(p + 17, 2), min = http_date_digits(p + 20, 2);
+    int sec = http_date_digits(p + 23, 2);
+    if (mon == 12 || day < 1 || day > 31 || year < 1970 || hour < 0 || hour > 23 ||
+        min < 0 || min > 59 || sec < 0 || sec > 60) {
+        return -1;
+    }
+
+    // Days since the epoch for a proleptic Gregorian date; March-based years
+    // put the leap day last
+    int m = mon + 1, y = year - (m <= 2);
+    long era = y / 400, yoe = y - era * 400;
+    long doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + day - 1;
+    long days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return (time_t)days * 86400 + hour * 3600 + min * 60 + sec;
+}
+
+// Whether a comma-separated list of entity tags names etag. Comparison is
+// weak, as If-None-Match requires: a W/ prefix is ignored.
+static inline int http_etag_listed(const http_slice *list, const char *etag) {
+    size_t etag_len = strlen(etag);
+    const char *p = list->ptr, *end = list->ptr + list->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p < end && *p == '*') {
+            return 1;
+        }
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/') {
+            p += 2;
+        }
+        const char *tag = p;
+        if (p < end && *p == '"') {
+            for (p++; p < end && *p != '"'; p++) {}
+            if (p < end) p++;
+        }
+        if ((size_t)(p - tag) == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+        while (p < end && *p != ',') p++;
+    }
+    return 0;
+}
+
+/* Returns whether the request's preconditions say the client's copy is
+ * current, so 304 Not Modified can be sent instead of the body. */
+static inline int http_not_modified(const http_request *req, const http_validators *v) {
+    const http_slice *value = http_get_header(req, "If-None-Match");
+    if (value != NULL) {
+        return http_etag_listed(value, v->etag);
+    }
+    value = http_get_header(req, "If-Modified-Since");
+    if (value != NULL) {
+        time_t since = http_parse_date(value->ptr, value->len);
+        return since >= 0 && v->mtime <= since;
+    }
+    return 0;
+}
+
+/* Returns whether a Range header may be honoured: without If-Range always,
+ * otherwise only if it names the current ETag (strong comparison) or the
+ * exact Last-Modified date. When it does not, the whole file is sent. */
+static inline int http_range_applies(const http_request *req, const http_validators *v) {
+    const http_slice *value = http_get_header(req, "If-Range");
+    if (value == NULL) {
+        return 1;
+    }
+    if (value->len > 0 && value->ptr[0] == '"') {
+        return value->len == strlen(v->etag) && memcmp(value->ptr, v->etag, value->len) == 0;
+    }
+    return http_parse_date(value->ptr, value->len) == v->mtime;
+}
+
+static inline void response_validators(response *r, const http_validators *v) {
+    response_printf(r, "ETag: %s\r\nLast-Modified: %s\r\n", v->etag, v->last_modified);
+}
+
+// A complete 304 response. It repeats the validators and Vary the 200
+// would have carried, and has no body.
+static inline void response_not_modified(response *r, const http_validators *v, const char *content_type,
+                                         int keep_alive) {
+    response_printf(r, "HTTP/1.1 304 Not Modified\r\n");
+    response_validators(r, v);
+    response_printf(r, "%sConnection: %s\r\n\r\n",
+                    content_type_compressible(content_type) ? "Vary: Accept-Encoding\r\n" : "",
+                    keep_alive ? "keep-alive" : "close");
+}
+
+#endif
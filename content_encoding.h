@@ -0,0 +1,148 @@
+/* content_encoding.h
+ * Accept-Encoding negotiation and body compression for file_cache.h.
+ *
+ * Brotli is preferred over gzip when the client accepts both. A response
+ * is compressed on the fly only when the server is built with -DWITH_ZLIB
+ * (link with -lz) and/or -DWITH_BROTLI (link with -lbrotlienc); without
+ * them, only precompressed .gz/.br siblings of a file are served.
+ */
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "http_parser.h"
+
+#define ENCODING_GZIP 1
+#define ENCODING_BR   2
+#define COMPRESS_MIN_SIZE 256  // smaller bodies are not worth compressing
+
+typedef struct {
+    int flag;
+    const char *name;    // Content-Encoding token
+    const char *suffix;  // extension of a precompressed sibling
+} content_encoding;
+
+// In order of preference
+static const content_encoding content_encodings[] = {
+    { ENCODING_BR, "br", ".br" },
+    { ENCODING_GZIP, "gzip", ".gz" },
+};
+#define NUM_CONTENT_ENCODINGS 2
+
+// Whether a q-value refuses the coding ("q=0", "q=0.0", ...).
+static inline int encoding_refused(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ';')) p++;
+    if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=') {
+        return 0;
+    }
+    for (p += 2; p < end && *p != ' ' && *p != '\t' && *p != ';'; p++) {
+        if (*p != '0' && *p != '.') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the ENCODING_* flags the request's Accept-Encoding allows. */
+static inline int accepted_encodings(const http_request *req) {
+    const http_slice *value = http_get_header(req, "Accept-Encoding");
+    if (value == NULL) {
+        return 0;
+    }
+    int accepted = 0, refused = 0, wildcard = 0;
+    const char *p = value->ptr, *end = value->ptr + value->len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *token = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        http_slice name = { token, (size_t)(p - token) };
+        const char *params = p;
+        while (p < end && *p != ',') p++;
+
+        int flag = 0;
+        if (http_slice_eq_nocase(name, "gzip") || http_slice_eq_nocase(name, "x-gzip")) {
+            flag = ENCODING_GZIP;
+        } else if (http_slice_eq_nocase(name, "br")) {
+            flag = ENCODING_BR;
+        } else if (http_slice_eq(name, "*")) {
+            wildcard = !encoding_refused(params, p);
+            continue;
+        }
+        if (encoding_refused(params, p)) {
+            refused |= flag;
+        } else {
+            accepted |= flag;
+        }
+    }
+    if (wildcard) {
+        accepted |= (ENCODING_GZIP | ENCODING_BR) & ~refused;
+    }
+    return accepted & ~refused;
+}
+
+// Whether a type benefits from compression (images and archives do not).
+static inline int content_type_compressible(const char *type) {
+    return strncmp(type, "text/", 5) == 0 || strstr(type, "javascript") != NULL ||
+           strstr(type, "json") != NULL || strstr(type, "xml") != NULL;
+}
+
+/* Compresses data into a malloc'ed buffer stored in *out. Returns the
+ * compressed size, or 0 when the encoding is not compiled in or the result
+ * would not be smaller than the input. */
+static inline size_t compress_body(int encoding, const char *data, size_t len, char **out) {
+    *out = NULL;
+    (void)data;
+    (void)len;
+#ifdef WITH_ZLIB
+    if (encoding == ENCODING_GZIP) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {  // +16: gzip wrapper
+            return 0;
+        }
+        size_t bound = deflateBound(&zs, len);
+        *out = malloc(bound);
+        zs.next_in = (Bytef *)data;
+        zs.avail_in = len;
+        zs.next_out = (Bytef *)*out;
+        zs.avail_out = bound;
+        int rc = *out != NULL ? deflate(&zs, Z_FINISH) : Z_MEM_ERROR;
+        size_t n = zs.total_out;
+        deflateEnd(&zs);
+        if (rc == Z_STREAM_END && n < len) {
+            return n;
+        }
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+#endif
+#ifdef WITH_BROTLI
+    if (encoding == ENCODING_BR) {
+        size_t n = BrotliEncoderMaxCompressedSize(len);
+        *out = n > 0 ? malloc(n) : NULL;
+        // Quality 5 compresses better than gzip -6 at a similar speed
+        if (*out != NULL && BrotliEncoderCompress(5, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, len,
+                                                  (const uint8_t *)data, &n, (uint8_t *)*out) &&
+            n < len) {
+            return n;
+        }
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+#endif
+    (void)encoding;
+    return 0;
+}
+
+#endif
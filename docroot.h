@@ -0,0 +1,300 @@
+/* docroot.h
+ * Index of the document root shared by the server variants.
+ *
+ * The root is opened once as a directory and request paths are resolved
+ * beneath it with openat2(RESOLVE_BENEATH), so "..", absolute symlinks and
+ * symlinks that lead out of the root fail instead of escaping it. Resolved
+ * files are kept in a hash table from URL path to an open descriptor, its
+ * stat data and its content type, so a hit costs no path walk at all.
+ * inotify watches the directories holding indexed files; an entry is
+ * dropped once its file is modified, replaced or removed. Pending events
+ * are picked up by docroot_refresh(), which lookups run at most once per
+ * DOCROOT_REFRESH seconds; event loops can also watch docroot_notify_fd().
+ *
+ * Descriptors are shared by every user of an entry, so they are only read
+ * with explicit offsets (pread(), sendfile() with an offset). Entries are
+ * reference counted and stay valid until released even if they are dropped
+ * meanwhile. The inotify instance is created on first use, so processes
+ * forked before serving get one each.
+ */
+#ifndef DOCROOT_H
+#define DOCROOT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <linux/openat2.h>
+
+#include "mime_types.h"
+
+#define DOCROOT_BUCKETS 1024
+#define DOCROOT_MAX_ENTRIES 512  // descriptors kept open; the oldest entry goes first
+#define DOCROOT_REFRESH 1        // seconds between inotify checks in lookups
+#define DOCROOT_INDEX "index.html"
+#define DOCROOT_WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | \
+                            IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct docroot_entry {
+    char *path;                // relative to the root, e.g. "dir/page.html"
+    const char *name;          // last component of path
+    uint32_t hash;
+    int fd;
+    struct stat st;
+    const char *content_type;  // from the extension, see mime_types.h
+    int wd;                    // inotify watch on the containing directory, or -1
+    int refs;                  // held by the index while linked, plus one per user
+    struct docroot_entry *hnext;
+    struct docroot_entry *prev, *next;  // oldest first
+} docroot_entry;
+
+typedef struct {
+    int dir_fd;
+    char *root;                // for inotify_add_watch(), which takes a path
+    int notify_fd;             // -1 until the first file is indexed
+    docroot_entry *buckets[DOCROOT_BUCKETS];
+    docroot_entry *oldest, *newest;
+    int count;
+    time_t refreshed;
+    pthread_mutex_t lock;
+} docroot_index;
+
+/* Opens path beneath dir_fd. Kernels without openat2() get a plain openat()
+ * that refuses ".." components, which does not contain symlinks. */
+static inline int docroot_openat(int dir_fd, const char *path, int flags) {
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+    int fd;
+    do {
+        fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+    } while (fd < 0 && errno == EAGAIN);  // a concurrent rename; just retry
+    if (fd >= 0 || errno != ENOSYS) {
+        return fd;
+    }
+    for (const char *p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            errno = EXDEV;
+            return -1;
+        }
+    }
+    return openat(dir_fd, path, flags | O_CLOEXEC);
+}
+
+// Returns 0, or -1 when root cannot be opened as a directory.
+static inline int docroot_init(docroot_index *d, const char *root) {
+    memset(d, 0, sizeof(*d));
+    d->notify_fd = -1;
+    d->dir_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    d->root = strdup(root);
+    if (d->dir_fd < 0 || d->root == NULL) {
+        return -1;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    return 0;
+}
+
+static inline uint32_t docroot_hash(const char *s) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static inline void docroot_entry_unref(docroot_entry *e) {
+    if (--e->refs == 0) {
+        close(e->fd);
+        free(e->path);
+        free(e);
+    }
+}
+
+// Drops an entry from the index; users still holding it keep it alive.
+static inline void docroot_unlink(docroot_index *d, docroot_entry *e) {
+    docroot_entry **pp = &d->buckets[e->hash % DOCROOT_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else d->oldest = e->next;
+    if (e->next) e->next->prev = e->prev; else d->newest = e->prev;
+    d->count--;
+    docroot_entry_unref(e);
+}
+
+// Returns the inotify descriptor, creating it if needed, or -1.
+static inline int docroot_notify_fd(docroot_index *d) {
+    if (d->notify_fd < 0) {
+        d->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    return d->notify_fd;
+}
+
+// Applies one inotify event: a change to a file drops its entry, losing a
+// directory (or events) drops everything that depended on it.
+static inline void docroot_apply_event(docroot_index *d, const struct inotify_event *ev) {
+    int all = ev->mask & IN_Q_OVERFLOW;
+    int whole_dir = ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED);
+    docroot_entry *e = d->oldest;
+    while (e != NULL) {
+        docroot_entry *next = e->next;
+        if (all || (e->wd == ev->wd && (whole_dir || (ev->len > 0 && strcmp(e->name, ev->name) == 0)))) {
+            docroot_unlink(d, e);
+        }
+        e = next;
+    }
+}
+
+// Drains pending inotify events. Call with d->lock held.
+static inline void docroot_refresh_locked(docroot_index *d) {
+    if (d->notify_fd < 0) {
+        return;
+    }
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(d->notify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            docroot_apply_event(d, (struct inotify_event *)p);
+        }
+    }
+}
+
+static inline void docroot_refresh(docroot_index *d) {
+    pthread_mutex_lock(&d->lock);
+    docroot_refresh_locked(d);
+    pthread_mutex_unlock(&d->lock);
+}
+
+/* Resolves path (relative to the root) and builds an unlinked entry, or
+ * returns NULL with errno set. The directory is only watched once the open
+ * has shown it lies beneath the root; stat data is taken after that, so
+ * later changes are not missed. */
+static inline docroot_entry *docroot_load(docroot_index *d, const char *path, uint32_t hash) {
+    // O_NONBLOCK so a FIFO in the root cannot stall the server
+    int fd = docroot_openat(d->dir_fd, path, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    const char *slash = strrchr(path, '/');
+    char dir[1024];
+    int len = slash != NULL ? snprintf(dir, sizeof(dir), "%s/%.*s", d->root, (int)(slash - path), path)
+                            : snprintf(dir, sizeof(dir), "%s", d->root);
+    pthread_mutex_lock(&d->lock);
+    int notify_fd = docroot_notify_fd(d);
+    pthread_mutex_unlock(&d->lock);
+    int wd = -1;
+    if (len < (int)sizeof(dir) && notify_fd >= 0) {
+        wd = inotify_add_watch(notify_fd, dir, DOCROOT_WATCH_MASK | IN_ONLYDIR);
+    }
+
+    struct stat st;
+    int err = fstat(fd, &st) < 0 ? errno : S_ISDIR(st.st_mode) ? EISDIR : S_ISREG(st.st_mode) ? 0 : ENOENT;
+    docroot_entry *e = err == 0 ? calloc(1, sizeof(docroot_entry)) : NULL;
+    if (e != NULL && (e->path = strdup(path)) == NULL) {
+        free(e);
+        e = NULL;
+    }
+    if (e == NULL) {
+        close(fd);
+        errno = err != 0 ? err : ENOMEM;
+        return NULL;
+    }
+    e->name = slash != NULL ? e->path + (slash - path) + 1 : e->path;
+    e->hash = hash;
+    e->fd = fd;
+    e->st = st;
+    e->content_type = mime_type_for(e->path);
+    e->wd = wd;
+    e->refs = 1;
+    return e;
+}
+
+/* Returns a referenced entry for a URL path ("/" and "" mean index.html), or
+ * NULL with errno set: EISDIR for directories, ENAMETOOLONG, and ENOENT,
+ * EXDEV (leaves the root), ELOOP or EACCES otherwise. Release with
+ * docroot_release(). */
+static inline docroot_entry *docroot_lookup(docroot_index *d, const char *url, size_t len) {
+    while (len > 0 && *url == '/') {
+        url++;
+        len--;
+    }
+    char path[512];
+    if (len == 0) {
+        url = DOCROOT_INDEX;
+        len = sizeof(DOCROOT_INDEX) - 1;
+    }
+    if (len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    if (memchr(url, '\0', len) != NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    memcpy(path, url, len);
+    path[len] = '\0';
+    uint32_t hash = docroot_hash(path);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    pthread_mutex_lock(&d->lock);
+    if (now.tv_sec - d->refreshed >= DOCROOT_REFRESH) {
+        docroot_refresh_locked(d);
+        d->refreshed = now.tv_sec;
+    }
+    for (docroot_entry *e = d->buckets[hash % DOCROOT_BUCKETS]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            e->refs++;
+            pthread_mutex_unlock(&d->lock);
+            return e;
+        }
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    // Resolve outside the lock so a slow disk does not stall other lookups
+    docroot_entry *loaded = docroot_load(d, path, hash);
+    if (loaded == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&d->lock);
+    for (docroot_entry *e = d->buckets[hash % DOCROOT_BUCKETS]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->path, path) == 0) {
+            // Someone else indexed it meanwhile
+            docroot_entry_unref(loaded);
+            e->refs++;
+            pthread_mutex_unlock(&d->lock);
+            return e;
+        }
+    }
+    loaded->hnext = d->buckets[hash % DOCROOT_BUCKETS];
+    d->buckets[hash % DOCROOT_BUCKETS] = loaded;
+    loaded->prev = d->newest;
+    if (d->newest) d->newest->next = loaded; else d->oldest = loaded;
+    d->newest = loaded;
+    if (++d->count > DOCROOT_MAX_ENTRIES) {
+        docroot_unlink(d, d->oldest);
+    }
+    loaded->refs++;
+    pthread_mutex_unlock(&d->lock);
+    return loaded;
+}
+
+static inline void docroot_release(docroot_index *d, docroot_entry *e) {
+    pthread_mutex_lock(&d->lock);
+    docroot_entry_unref(e);
+    pthread_mutex_unlock(&d->lock);
+}
+
+#endif
@@ -0,0 +1,427 @@
+/* file_cache.h
+ * In-memory cache of small, frequently requested files shared by the
+ * server variants.
+ *
+ * Each entry keeps the file contents together with a pre-rendered response
+ * header (status line, Content-Length, Content-Type, validators and, where
+ * relevant, Content-Encoding and Vary), so a hit is served with a single
+ * writev() and no filesystem syscalls. The validators are kept apart as
+ * well so revalidations can be answered with 304 from the entry alone.
+ * Only the Connection header is left to the caller since it varies per
+ * request.
+ *
+ * file_cache_get_encoded() also caches compressed variants of a file under
+ * "path\nencoding": a precompressed .br/.gz sibling when there is one,
+ * otherwise the file compressed on first request (see content_encoding.h).
+ * When neither is available a placeholder entry remembers that, so misses
+ * are not retried on every request; that includes files too large to cache
+ * that have no sibling, which file_cache_eligible() otherwise lets through.
+ * A variant depends on two files, the plain file and its sibling, and is
+ * rebuilt when either changes: a sibling that appears is picked up, and one
+ * older than the plain file is taken to be left over from before an edit
+ * and is not served.
+ *
+ * Paths are relative to the document root and opened beneath it (see
+ * docroot.h), so they can never lead outside it.
+ *
+ * Entries are revalidated against the mtime and size of the files they were
+ * built from at most once every FILE_CACHE_REVALIDATE seconds. The total
+ * size is capped at FILE_CACHE_MAX_BYTES with least-recently-used eviction.
+ * Lookups are guarded by a mutex so the thread pool in server3.c can share
+ * one cache; entries are reference counted and stay valid until released
+ * even if they are evicted meanwhile.
+ */
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "content_encoding.h"
+#include "conditional.h"
+#include "docroot.h"
+
+#define FILE_CACHE_MAX_BYTES (64 * 1024 * 1024)  // total bytes of cached bodies
+#define FILE_CACHE_MAX_FILE  (1024 * 1024)       // larger files are sent with sendfile()
+#define FILE_CACHE_BUCKETS   1024
+#define FILE_CACHE_REVALIDATE 1                  // seconds between mtime/size checks
+
+typedef struct cache_entry {
+    char *key;               // file path, or "path\nencoding" for a compressed variant
+    char *path;              // file the entry was built from (the plain file), checked for changes
+    char *sibling;           // variants: the precompressed sibling, also checked; else NULL
+    uint32_t hash;
+    char *data;
+    size_t size;
+    int missing;             // placeholder: no such variant, use the plain file
+    const char *content_type;  // static string, as passed to cache_entry_new()
+    char header[384];        // "HTTP/1.1 200 OK\r\n...", without Connection
+    size_t header_len;
+    http_validators validators;  // of this representation
+    struct timespec mtime;   // of path when the entry was built
+    off_t file_size;         // of path when the entry was built
+    struct timespec sibling_mtime;
+    off_t sibling_size;      // of sibling when the entry was built, or -1 if there was none
+    time_t checked;          // when mtime/size were last compared
+    int refs;                // held by the cache while linked, plus one per user
+    struct cache_entry *hnext;
+    struct cache_entry *lru_prev, *lru_next;  // most recently used first
+} cache_entry;
+
+typedef struct {
+    cache_entry *buckets[FILE_CACHE_BUCKETS];
+    cache_entry *lru_head, *lru_tail;
+    size_t bytes;
+    int root_fd;             // directory the paths are relative to
+    pthread_mutex_t lock;
+} file_cache;
+
+static inline void file_cache_init(file_cache *cache, int root_fd) {
+    memset(cache, 0, sizeof(*cache));
+    cache->root_fd = root_fd;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+static inline uint32_t file_cache_hash(const char *s) {
+    uint32_t h = 2166136261u;  // FNV-1a
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+static inline time_t file_cache_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static inline void cache_entry_unref(cache_entry *e) {
+    if (--e->refs == 0) {
+        if (e->path != e->key) {
+            free(e->path);
+        }
+        free(e->sibling);
+        free(e->key);
+        free(e->data);
+        free(e);
+    }
+}
+
+static inline void file_cache_lru_unlink(file_cache *cache, cache_entry *e) {
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next; else cache->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev; else cache->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = NULL;
+}
+
+static inline void file_cache_lru_push(file_cache *cache, cache_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head) cache->lru_head->lru_prev = e; else cache->lru_tail = e;
+    cache->lru_head = e;
+}
+
+// Drops an entry from the table; users still holding it keep it alive.
+static inline void file_cache_unlink(file_cache *cache, cache_entry *e) {
+    cache_entry **pp = &cache->buckets[e->hash % FILE_CACHE_BUCKETS];
+    while (*pp != e) {
+        pp = &(*pp)->hnext;
+    }
+    *pp = e->hnext;
+    file_cache_lru_unlink(cache, e);
+    cache->bytes -= e->size;
+    cache_entry_unref(e);
+}
+
+static inline cache_entry *file_cache_lookup(file_cache *cache, const char *key, uint32_t hash) {
+    for (cache_entry *e = cache->buckets[hash % FILE_CACHE_BUCKETS]; e; e = e->hnext) {
+        if (e->hash == hash && strcmp(e->key, key) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Stats a file beneath the root. Returns 0 for a regular file, else -1.
+static inline int file_cache_stat(const file_cache *cache, const char *path, struct stat *st) {
+    int fd = docroot_openat(cache->root_fd, path, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fstat(fd, st) == 0 && S_ISREG(st->st_mode) ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+// Reads a regular file small enough to cache into a malloc'ed buffer.
+// Returns NULL otherwise.
+static inline char *file_cache_read(const file_cache *cache, const char *path, struct stat *st) {
+    int fd = docroot_openat(cache->root_fd, path, O_RDONLY | O_NONBLOCK | O_NOCTTY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode) || st->st_size > FILE_CACHE_MAX_FILE) {
+        close(fd);
+        return NULL;
+    }
+    char *data = malloc(st->st_size > 0 ? st->st_size : 1);
+    size_t got = 0;
+    while (data && got < (size_t)st->st_size) {
+        ssize_t n = read(fd, data + got, st->st_size - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    close(fd);
+    if (data == NULL || got != (size_t)st->st_size) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/* Builds an entry that owns data. path may be NULL when it equals key;
+ * encoding is NULL for the plain file. */
+static inline cache_entry *cache_entry_new(const char *key, uint32_t hash, const char *path,
+                                           const struct timespec *mtime, off_t file_size,
+                                           char *data, size_t size,
+                                           const char *content_type, const char *encoding) {
+    cache_entry *e = calloc(1, sizeof(cache_entry));
+    char *key_copy = strdup(key);
+    char *path_copy = path != NULL ? strdup(path) : key_copy;
+    if (e == NULL || key_copy == NULL || path_copy == NULL) {
+        free(e);
+        if (path_copy != key_copy) free(path_copy);
+        free(key_copy);
+        free(data);
+        return NULL;
+    }
+    e->key = key_copy;
+    e->path = path_copy;
+    e->hash = hash;
+    e->data = data;
+    e->size = size;
+    e->mtime = *mtime;
+    e->file_size = file_size;
+    e->checked = file_cache_now();
+    e->refs = 1;
+    e->content_type = content_type;
+    http_validators_init(&e->validators, mtime, file_size, encoding);
+    // Caches between us and the client must keep the variants apart
+    const char *vary = content_type_compressible(content_type) ? "Vary: Accept-Encoding\r\n" : "";
+    if (encoding != NULL) {
+        e->header_len = snprintf(e->header, sizeof(e->header),
+                                 "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: %s\r\n"
+                                 "Content-Encoding: %s\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+                                 size, content_type, encoding, e->validators.etag,
+                                 e->validators.last_modified, vary);
+    } else {
+        e->header_len = snprintf(e->header, sizeof(e->header),
+                                 "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: %s\r\n"
+                                 "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s",
+                                 size, content_type, e->validators.etag, e->validators.last_modified, vary);
+    }
+    return e;
+}
+
+// Returns whether a file still has the mtime and size seen; size -1 means
+// it was not there and must still not be.
+static inline int file_cache_unchanged(const file_cache *cache, const char *path,
+                                       const struct timespec *mtime, off_t size) {
+    struct stat st;
+    if (fstatat(cache->root_fd, path, &st, 0) < 0 || !S_ISREG(st.st_mode)) {
+        return size < 0;
+    }
+    return st.st_size == size && st.st_mtim.tv_sec == mtime->tv_sec && st.st_mtim.tv_nsec == mtime->tv_nsec;
+}
+
+// Returns whether the cached copy still matches the files on disk.
+static inline int file_cache_fresh(const file_cache *cache, cache_entry *e, time_t now) {
+    if (now - e->checked < FILE_CACHE_REVALIDATE) {
+        return 1;
+    }
+    if (!file_cache_unchanged(cache, e->path, &e->mtime, e->file_size) ||
+        (e->sibling != NULL && !file_cache_unchanged(cache, e->sibling, &e->sibling_mtime, e->sibling_size))) {
+        return 0;
+    }
+    e->checked = now;
+    return 1;
+}
+
+// Returns a referenced, fresh entry for key, or NULL. Stale entries are dropped.
+static inline cache_entry *file_cache_find(file_cache *cache, const char *key, uint32_t hash) {
+    time_t now = file_cache_now();
+    pthread_mutex_lock(&cache->lock);
+    cache_entry *e = file_cache_lookup(cache, key, hash);
+    if (e != NULL) {
+        if (file_cache_fresh(cache, e, now)) {
+            file_cache_lru_unlink(cache, e);
+            file_cache_lru_push(cache, e);
+            e->refs++;
+            pthread_mutex_unlock(&cache->lock);
+            return e;
+        }
+        file_cache_unlink(cache, e);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+// Links a freshly built entry and returns it referenced. If someone else
+// inserted the same key meanwhile, theirs is returned instead.
+static inline cache_entry *file_cache_insert(file_cache *cache, cache_entry *loaded) {
+    pthread_mutex_lock(&cache->lock);
+    cache_entry *e = file_cache_lookup(cache, loaded->key, loaded->hash);
+    if (e != NULL) {
+        cache_entry_unref(loaded);
+    } else {
+        e = loaded;
+        e->hnext = cache->buckets[e->hash % FILE_CACHE_BUCKETS];
+        cache->buckets[e->hash % FILE_CACHE_BUCKETS] = e;
+        file_cache_lru_push(cache, e);
+        cache->bytes += e->size;
+        while (cache->bytes > FILE_CACHE_MAX_BYTES && cache->lru_tail != e) {
+            file_cache_unlink(cache, cache->lru_tail);
+        }
+    }
+    e->refs++;
+    pthread_mutex_unlock(&cache->lock);
+    return e;
+}
+
+/* Returns a referenced entry for path, loading it on a miss, or NULL when
+ * the file is missing, not a regular file or too large to cache; callers
+ * then fall back to the uncached path. Release with file_cache_release(). */
+static inline cache_entry *file_cache_get(file_cache *cache, const char *path, const char *content_type) {
+    uint32_t hash = file_cache_hash(path);
+    cache_entry *e = file_cache_find(cache, path, hash);
+    if (e != NULL) {
+        return e;
+    }
+
+    // Load outside the lock so a slow disk does not stall other lookups
+    struct stat st;
+    char *data = file_cache_read(cache, path, &st);
+    if (data == NULL) {
+        return NULL;
+    }
+    e = cache_entry_new(path, hash, NULL, &st.st_mtim, st.st_size, data, st.st_size, content_type, NULL);
+    return e != NULL ? file_cache_insert(cache, e) : NULL;
+}
+
+/* Whether a file is worth asking the cache for: small files are cached
+ * whole, larger ones only for a compressed variant, so a large file of a
+ * type that is never compressed goes straight to disk. */
+static inline int file_cache_eligible(off_t size, const char *content_type, int accepted) {
+    return size <= FILE_CACHE_MAX_FILE || (accepted != 0 && content_type_compressible(content_type));
+}
+
+static inline void file_cache_release(file_cache *cache, cache_entry *e) {
+    pthread_mutex_lock(&cache->lock);
+    cache_entry_unref(e);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Builds the variant of path in one encoding: the precompressed sibling if
+// there is one no older than path, else the plain entry compressed. Returns
+// a placeholder when neither works, or NULL when path itself cannot be cached.
+static inline cache_entry *file_cache_build_variant(file_cache *cache, const char *key, uint32_t hash,
+                                                    const char *path, const char *content_type,
+                                                    const content_encoding *enc) {
+    struct stat source;
+    if (file_cache_stat(cache, path, &source) < 0) {
+        return NULL;
+    }
+    char sibling[1024];
+    struct stat st = { 0 };
+    int named = snprintf(sibling, sizeof(sibling), "%s%s", path, enc->suffix) < (int)sizeof(sibling);
+    int found = named && file_cache_stat(cache, sibling, &st) == 0;
+    char *data = NULL;
+    size_t size = 0;
+    cache_entry *e;
+    if (found && (st.st_mtim.tv_sec > source.st_mtim.tv_sec ||
+                  (st.st_mtim.tv_sec == source.st_mtim.tv_sec && st.st_mtim.tv_nsec >= source.st_mtim.tv_nsec)) &&
+        (data = file_cache_read(cache, sibling, &st)) != NULL) {
+        e = cache_entry_new(key, hash, path, &source.st_mtim, source.st_size, data, st.st_size,
+                            content_type, enc->name);
+    } else {
+        cache_entry *plain = file_cache_get(cache, path, content_type);
+        if (plain == NULL && source.st_size <= FILE_CACHE_MAX_FILE) {
+            return NULL;
+        }
+        if (plain == NULL) {
+            // Too large to compress in memory: remember there is no variant
+            e = cache_entry_new(key, hash, path, &source.st_mtim, source.st_size, NULL, 0,
+                                content_type, enc->name);
+        } else {
+            if (plain->size >= COMPRESS_MIN_SIZE) {
+                size = compress_body(enc->flag, plain->data, plain->size, &data);
+            }
+            e = cache_entry_new(key, hash, path, &plain->mtime, plain->file_size, data, size,
+                                content_type, enc->name);
+            file_cache_release(cache, plain);
+        }
+        if (e != NULL && data == NULL) {
+            e->missing = 1;
+        }
+    }
+
+    // Watch the sibling too, whether it was used, ignored or absent
+    if (e != NULL && named) {
+        if ((e->sibling = strdup(sibling)) == NULL) {
+            cache_entry_unref(e);
+            return NULL;
+        }
+        e->sibling_mtime = st.st_mtim;
+        e->sibling_size = found ? st.st_size : -1;
+    }
+    return e;
+}
+
+/* Like file_cache_get(), but returns the best variant for the encodings in
+ * accepted (ENCODING_* flags) when the type is worth compressing. A file
+ * too large to cache whole is only returned as a variant. */
+static inline cache_entry *file_cache_get_encoded(file_cache *cache, const char *path,
+                                                  const char *content_type, int accepted) {
+    if (accepted == 0 || !content_type_compressible(content_type)) {
+        return file_cache_get(cache, path, content_type);
+    }
+    for (int i = 0; i < NUM_CONTENT_ENCODINGS; i++) {
+        const content_encoding *enc = &content_encodings[i];
+        if (!(accepted & enc->flag)) {
+            continue;
+        }
+        char key[1024];
+        if (snprintf(key, sizeof(key), "%s\n%s", path, enc->name) >= (int)sizeof(key)) {
+            break;
+        }
+        uint32_t hash = file_cache_hash(key);
+        cache_entry *e = file_cache_find(cache, key, hash);
+        if (e == NULL) {
+            e = file_cache_build_variant(cache, key, hash, path, content_type, enc);
+            if (e == NULL) {
+                return NULL;  // the file itself is missing or too large
+            }
+            e = file_cache_insert(cache, e);
+        }
+        if (!e->missing) {
+            return e;
+        }
+        int too_large = e->file_size > FILE_CACHE_MAX_FILE;
+        file_cache_release(cache, e);
+        if (too_large) {
+            return NULL;
+        }
+    }
+    return file_cache_get(cache, path, content_type);
+}
+
+#endif
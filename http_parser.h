@@ -0,0 +1,209 @@
+/* http_parser.h
+ * Incremental HTTP/1.x request parser shared by the server variants.
+ *
+ * The parser never copies or allocates: method, path, version and headers
+ * are returned as slices pointing into the caller's buffer, which must stay
+ * put until the request has been answered. It can be fed a growing buffer
+ * one read at a time; bytes already scanned are not looked at again.
+ *
+ * Usage:
+ *     http_request req;
+ *     http_request_init(&req);
+ *     ... append data to buf ...
+ *     int n = http_parse_request(&req, buf, len);
+ *     if (n > 0)  the request head is the first n bytes of buf
+ *     if (n == HTTP_PARSE_INCOMPLETE)  read more and call again
+ *     if (n == HTTP_PARSE_ERROR)  answer 400 and close
+ */
+#ifndef HTTP_PARSER_H
+#define HTTP_PARSER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define HTTP_MAX_HEADERS 32
+#define HTTP_MAX_HEAD 8192  // request head the servers buffer; a longer one is answered 431
+
+#define HTTP_PARSE_ERROR      -1
+#define HTTP_PARSE_INCOMPLETE -2
+
+typedef struct {
+    const char *ptr;
+    size_t len;
+} http_slice;
+
+typedef struct {
+    http_slice name;
+    http_slice value;
+} http_header;
+
+typedef struct {
+    http_slice method;
+    http_slice path;
+    http_slice version;     // "HTTP/1.0" or "HTTP/1.1"
+    int minor_version;
+    http_header headers[HTTP_MAX_HEADERS];
+    int num_headers;
+    size_t scanned;         // bytes already searched for the end of the head
+} http_request;
+
+static inline void http_request_init(http_request *req) {
+    req->num_headers = 0;
+    req->scanned = 0;
+}
+
+/* Returns a pointer to the first occurrence of a or b in [p, end), or end.
+ * Works 16 bytes at a time where SSE2 is available. */
+static inline const char *http_find2(const char *p, const char *end, char a, char b) {
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a);
+    const __m128i vb = _mm_set1_epi8(b);
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va),
+                                                  _mm_cmpeq_epi8(chunk, vb)));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && *p != a && *p != b) {
+        p++;
+    }
+    return p;
+}
+
+/* Locates the blank line ending the request head. Returns the length of
+ * the head including the final CRLFCRLF, or 0 if it is not complete yet. */
+static inline size_t http_find_head_end(http_request *req, const char *buf, size_t len) {
+    // Resume a few bytes back in case the terminator straddled two reads
+    const char *p = buf + (req->scanned > 3 ? req->scanned - 3 : 0);
+    const char *end = buf + len;
+    while ((p = http_find2(p, end, '\r', '\r')) < end) {
+        if (end - p < 4) {
+            break;
+        }
+        if (p[1] == '\n' && p[2] == '\r' && p[3] == '\n') {
+            return p + 4 - buf;
+        }
+        p++;
+    }
+    req->scanned = len;
+    return 0;
+}
+
+static inline int http_slice_eq(http_slice s, const char *str) {
+    size_t n = strlen(str);
+    return s.len == n && memcmp(s.ptr, str, n) == 0;
+}
+
+static inline int http_slice_eq_nocase(http_slice s, const char *str) {
+    size_t n = strlen(str);
+    return s.len == n && strncasecmp(s.ptr, str, n) == 0;
+}
+
+/* Returns the value of the named header, or NULL if the request lacks it. */
+static inline const http_slice *http_get_header(const http_request *req, const char *name) {
+    for (int i = 0; i < req->num_headers; i++) {
+        if (http_slice_eq_nocase(req->headers[i].name, name)) {
+            return &req->headers[i].value;
+        }
+    }
+    return NULL;
+}
+
+/* Parses the request head at the start of buf. See the usage note above
+ * for the return values. */
+static inline int http_parse_request(http_request *req, const char *buf, size_t len) {
+    size_t head_len = http_find_head_end(req, buf, len);
+    if (head_len == 0) {
+        return HTTP_PARSE_INCOMPLETE;
+    }
+
+    const char *p = buf;
+    const char *end = buf + head_len - 2;  // the final CRLF ends the header list
+    const char *tok;
+
+    // Request line: METHOD SP PATH SP VERSION CRLF
+    tok = p;
+    p = http_find2(p, end, ' ', '\r');
+    if (p == tok || p == end || *p != ' ') {
+        return HTTP_PARSE_ERROR;
+    }
+    req->method.ptr = tok;
+    req->method.len = p - tok;
+
+    tok = ++p;
+    p = http_find2(p, end, ' ', '\r');
+    if (p == tok || p == end || *p != ' ' || (*tok != '/' && *tok != '*')) {
+        return HTTP_PARSE_ERROR;
+    }
+    req->path.ptr = tok;
+    req->path.len = p - tok;
+
+    tok = ++p;
+    p = http_find2(p, end, '\r', '\r');
+    if (p - tok != 8 || memcmp(tok, "HTTP/1.", 7) != 0 || tok[7] < '0' || tok[7] > '9' ||
+        p[1] != '\n') {
+        return HTTP_PARSE_ERROR;
+    }
+    req->version.ptr = tok;
+    req->version.len = 8;
+    req->minor_version = tok[7] - '0';
+    p += 2;
+
+    // Header lines: NAME ":" OWS VALUE OWS CRLF
+    req->num_headers = 0;
+    while (p < end) {
+        if (req->num_headers == HTTP_MAX_HEADERS) {
+            return HTTP_PARSE_ERROR;
+        }
+        http_header *h = &req->headers[req->num_headers];
+
+        tok = p;
+        p = http_find2(p, end, ':', '\r');
+        if (p == tok || p == end || *p != ':') {
+            return HTTP_PARSE_ERROR;
+        }
+        h->name.ptr = tok;
+        h->name.len = p - tok;
+
+        p++;
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+        tok = p;
+        p = http_find2(p, end, '\r', '\r');
+        if (p == end || p[1] != '\n') {
+            return HTTP_PARSE_ERROR;
+        }
+        const char *value_end = p;
+        while (value_end > tok && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+            value_end--;
+        }
+        h->value.ptr = tok;
+        h->value.len = value_end - tok;
+        req->num_headers++;
+        p += 2;
+    }
+
+    return (int)head_len;
+}
+
+/* HTTP/1.1 connections persist unless the client asks otherwise; 1.0
+ * connections only persist when the client asks for it. */
+static inline int http_wants_keep_alive(const http_request *req) {
+    const http_slice *conn = http_get_header(req, "Connection");
+    if (req->minor_version >= 1) {
+        return conn == NULL || !http_slice_eq_nocase(*conn, "close");
+    }
+    return conn != NULL && http_slice_eq_nocase(*conn, "keep-alive");
+}
+
+#endif
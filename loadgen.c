@@ -0,0 +1,502 @@
+/* loadgen.c
+ * HTTP load generator for comparing the server variants.
+ *
+ * Each thread drives its share of the connections from its own epoll loop.
+ * In closed-loop mode (the default) every connection sends its next request
+ * as soon as the previous response arrives. With -r the generator is open
+ * loop: requests are issued on a fixed schedule regardless of how fast the
+ * server answers, and latency is measured from the scheduled send time so a
+ * stalled server cannot hide its queueing delay.
+ *
+ * Latencies go into HDR-style log-linear histograms (about 1% precision)
+ * kept per thread and merged at the end.
+ *
+ * Usage: loadgen [options] <host> <port> [path ...]
+ *   -t threads      worker threads (default 2)
+ *   -c connections  concurrent connections, spread over the threads (default 50)
+ *   -d seconds      test duration (default 10)
+ *   -k              reuse connections (HTTP keep-alive); default is one request per connection
+ *   -r rate         open loop at this many requests/s in total
+ *   -s              print a single summary line (used by bench.sh)
+ * Paths are requested round-robin; the default is "/".
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#define HDR_SUB_BITS 7                          // 128 sub-buckets per power of two
+#define HDR_SUB (1 << HDR_SUB_BITS)
+#define HDR_BUCKETS (HDR_SUB + 58 * (HDR_SUB / 2))
+#define RESPONSE_BUFFER 16384
+#define MAX_PENDING 65536                       // open-loop requests waiting for a free connection
+
+typedef struct {
+    uint64_t counts[HDR_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+static int hdr_index(uint64_t v) {
+    if (v < HDR_SUB) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - HDR_SUB_BITS + 1;
+    return HDR_SUB + (shift - 1) * (HDR_SUB / 2) + (int)((v >> shift) - HDR_SUB / 2);
+}
+
+// Upper edge of a bucket, so reported percentiles never understate latency.
+static uint64_t hdr_value(int index) {
+    if (index < HDR_SUB) {
+        return index;
+    }
+    int k = index - HDR_SUB;
+    int shift = k / (HDR_SUB / 2) + 1;
+    uint64_t sub = k % (HDR_SUB / 2) + HDR_SUB / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hdr_record(Histogram *h, uint64_t v) {
+    h->counts[hdr_index(v)]++;
+    h->total++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static void hdr_merge(Histogram *into, const Histogram *from) {
+    for (int i = 0; i < HDR_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static uint64_t hdr_percentile(const Histogram *h, double p) {
+    uint64_t target = (uint64_t)(h->total * p / 100.0 + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HDR_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = hdr_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+typedef enum { C_IDLE, C_CONNECTING, C_SENDING, C_READING } ConnState;
+
+typedef struct {
+    int fd;
+    ConnState state;
+    const char *request;
+    size_t request_len;
+    size_t sent;
+    char buf[RESPONSE_BUFFER];
+    size_t buf_len;
+    int header_done;
+    long long body_left;  // -1 until Content-Length is known
+    int server_closes;
+    uint64_t start_us;    // when the request was (or was scheduled to be) sent
+} Conn;
+
+typedef struct {
+    int id;
+    int nconns;
+    double rate;          // requests/s for this thread in open-loop mode, 0 for closed loop
+    pthread_t thread;
+    Histogram hist;
+    uint64_t completed, errors, non2xx, bytes, dropped;
+} Worker;
+
+static struct sockaddr_in server_addr;
+static char **requests;
+static size_t *request_lens;
+static int nrequests;
+static int keep_alive;
+static volatile int running = 1;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int conn_open(int epfd, Conn *c) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    c->state = C_CONNECTING;
+    return 0;
+}
+
+static void conn_close(Conn *c) {
+    if (c->fd >= 0) {
+        close(c->fd);  // also drops it from the epoll set
+    }
+    c->fd = -1;
+    c->state = C_IDLE;
+}
+
+static void conn_watch(int epfd, Conn *c, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+// Starts a request on c; the connection is opened first if needed.
+static void conn_start(Worker *w, int epfd, Conn *c, uint64_t start_us, unsigned *next_path) {
+    int i = (*next_path)++ % nrequests;
+    c->request = requests[i];
+    c->request_len = request_lens[i];
+    c->sent = 0;
+    c->buf_len = 0;
+    c->header_done = 0;
+    c->body_left = -1;
+    c->server_closes = !keep_alive;
+    c->start_us = start_us;
+    if (c->fd < 0) {
+        if (conn_open(epfd, c) < 0) {
+            w->errors++;
+        }
+        return;
+    }
+    c->state = C_SENDING;
+    conn_watch(epfd, c, EPOLLOUT);
+}
+
+// Parses the response head in c->buf. Returns -1 on a malformed response.
+static int parse_head(Worker *w, Conn *c) {
+    char *end = memmem(c->buf, c->buf_len, "\r\n\r\n", 4);
+    if (end == NULL) {
+        return c->buf_len == sizeof(c->buf) ? -1 : 0;
+    }
+    size_t head_len = end + 4 - c->buf;
+    *end = '\0';
+    int status = 0;
+    if (sscanf(c->buf, "HTTP/1.%*d %d", &status) != 1) {
+        return -1;
+    }
+    if (status < 200 || status > 299) {
+        w->non2xx++;
+    }
+    // 1xx, 204 and 304 responses never have a body, whatever their headers say
+    if (status < 200 || status == 204 || status == 304) {
+        c->body_left = 0;
+    } else {
+        const char *cl = strcasestr(c->buf, "\r\nContent-Length:");
+        if (cl == NULL) {
+            return -1;
+        }
+        c->body_left = atoll(cl + 17);
+    }
+    const char *conn_header = strcasestr(c->buf, "\r\nConnection:");
+    if (conn_header != NULL && strncasecmp(conn_header + 13, " close", 6) == 0) {
+        c->server_closes = 1;
+    }
+    c->header_done = 1;
+    c->body_left -= c->buf_len - head_len;
+    w->bytes += c->buf_len;
+    c->buf_len = 0;
+    return 1;
+}
+
+// Returns 1 when the response is complete, 0 when more data is needed and
+// -1 on errors or an early close.
+static int conn_read(Worker *w, Conn *c) {
+    while (1) {
+        if (!c->header_done) {
+            ssize_t n = recv(c->fd, c->buf + c->buf_len, sizeof(c->buf) - c->buf_len, 0);
+            if (n <= 0) {
+                return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+            }
+            c->buf_len += n;
+            int r = parse_head(w, c);
+            if (r < 0) {
+                return -1;
+            }
+            if (r == 0) {
+                continue;
+            }
+        } else {
+            if (c->body_left <= 0) {
+                return 1;
+            }
+            ssize_t n = recv(c->fd, c->buf, sizeof(c->buf), 0);
+            if (n <= 0) {
+                return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+            }
+            c->body_left -= n;
+            w->bytes += n;
+        }
+        if (c->header_done && c->body_left <= 0) {
+            return 1;
+        }
+    }
+}
+
+static void *worker_run(void *arg) {
+    Worker *w = arg;
+    int epfd = epoll_create1(0);
+    Conn *conns = calloc(w->nconns, sizeof(Conn));
+    Conn **idle = calloc(w->nconns, sizeof(Conn *));
+    uint64_t *pending = w->rate > 0 ? malloc(MAX_PENDING * sizeof(uint64_t)) : NULL;
+    struct epoll_event *events = calloc(w->nconns + 1, sizeof(struct epoll_event));
+    if (epfd < 0 || conns == NULL || idle == NULL || events == NULL || (w->rate > 0 && pending == NULL)) {
+        perror("worker setup");
+        exit(1);
+    }
+    size_t pending_head = 0, pending_len = 0;
+    int nidle = 0;
+    unsigned next_path = w->id;
+
+    for (int i = 0; i < w->nconns; i++) {
+        conns[i].fd = -1;
+        if (w->rate > 0) {
+            conns[i].state = C_IDLE;
+            idle[nidle++] = &conns[i];
+        } else {
+            conn_start(w, epfd, &conns[i], now_us(), &next_path);
+        }
+    }
+
+    uint64_t interval_us = w->rate > 0 ? (uint64_t)(1e6 / w->rate) : 0;
+    uint64_t next_send = now_us();
+
+    while (running) {
+        int timeout = 100;
+        if (w->rate > 0) {
+            // Queue every request whose scheduled time has come
+            uint64_t now = now_us();
+            while (next_send <= now) {
+                if (pending_len < MAX_PENDING) {
+                    pending[(pending_head + pending_len++) % MAX_PENDING] = next_send;
+                } else {
+                    w->dropped++;
+                }
+                next_send += interval_us > 0 ? interval_us : 1;
+            }
+            while (pending_len > 0 && nidle > 0) {
+                Conn *c = idle[--nidle];
+                conn_start(w, epfd, c, pending[pending_head], &next_path);
+                pending_head = (pending_head + 1) % MAX_PENDING;
+                pending_len--;
+            }
+            timeout = (int)((next_send - now + 999) / 1000);
+        }
+
+        int n = epoll_wait(epfd, events, w->nconns + 1, timeout);
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            int done = 0, failed = 0;
+
+            if (c->state == C_IDLE) {
+                // Parked connections only wait for a hangup or error: the
+                // server closed it. Drop it; it is reopened when next used.
+                conn_close(c);
+                continue;
+            }
+            if (c->state == C_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                if (err != 0) {
+                    failed = 1;
+                } else {
+                    c->state = C_SENDING;
+                }
+            }
+            if (!failed && c->state == C_SENDING) {
+                ssize_t s = send(c->fd, c->request + c->sent, c->request_len - c->sent, MSG_NOSIGNAL);
+                if (s < 0 && ((errno != EAGAIN && errno != EINTR) || (events[i].events & (EPOLLHUP | EPOLLERR)))) {
+                    failed = 1;
+                } else if (s > 0 && (c->sent += s) == c->request_len) {
+                    c->state = C_READING;
+                    conn_watch(epfd, c, EPOLLIN);
+                }
+            } else if (!failed && c->state == C_READING && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                int r = conn_read(w, c);
+                failed = r < 0;
+                done = r > 0;
+            }
+
+            if (done) {
+                hdr_record(&w->hist, now_us() - c->start_us);
+                w->completed++;
+                if (c->server_closes) {
+                    conn_close(c);
+                } else {
+                    c->state = C_IDLE;
+                    conn_watch(epfd, c, EPOLLRDHUP);
+                }
+            } else if (failed) {
+                w->errors++;
+                conn_close(c);
+            } else {
+                continue;
+            }
+
+            // The connection is free for the next request
+            if (!running) {
+                continue;
+            }
+            if (w->rate > 0) {
+                if (pending_len > 0) {
+                    conn_start(w, epfd, c, pending[pending_head], &next_path);
+                    pending_head = (pending_head + 1) % MAX_PENDING;
+                    pending_len--;
+                } else {
+                    idle[nidle++] = c;
+                }
+            } else {
+                conn_start(w, epfd, c, now_us(), &next_path);
+            }
+        }
+    }
+
+    for (int i = 0; i < w->nconns; i++) {
+        conn_close(&conns[i]);
+    }
+    close(epfd);
+    free(conns);
+    free(idle);
+    free(pending);
+    free(events);
+    return NULL;
+}
+
+static void stop(int sig) {
+    (void)sig;
+    running = 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-t threads] [-c connections] [-d seconds] [-k] [-r rate] [-s] "
+                    "<host> <port> [path ...]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    int nthreads = 2, nconns = 50, duration = 10, summary = 0;
+    double rate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:c:d:kr:s")) != -1) {
+        switch (opt) {
+        case 't': nthreads = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 'd': duration = atoi(optarg); break;
+        case 'k': keep_alive = 1; break;
+        case 'r': rate = atof(optarg); break;
+        case 's': summary = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind < 2 || nthreads <= 0 || nconns < nthreads || duration <= 0) {
+        usage(argv[0]);
+    }
+    const char *host = argv[optind];
+    const char *port = argv[optind + 1];
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        fprintf(stderr, "ERROR: cannot resolve %s\n", host);
+        return 1;
+    }
+    memcpy(&server_addr, res->ai_addr, sizeof(server_addr));
+    freeaddrinfo(res);
+
+    // Pre-format one request per path
+    char *default_path[] = { "/" };
+    char **paths = argc - optind > 2 ? &argv[optind + 2] : default_path;
+    nrequests = argc - optind > 2 ? argc - optind - 2 : 1;
+    requests = calloc(nrequests, sizeof(char *));
+    request_lens = calloc(nrequests, sizeof(size_t));
+    for (int i = 0; i < nrequests; i++) {
+        size_t len = strlen(paths[i]) + strlen(host) + 128;
+        requests[i] = malloc(len);
+        request_lens[i] = snprintf(requests[i], len, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                                   paths[i], host, keep_alive ? "keep-alive" : "close");
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop);
+
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    uint64_t start = now_us();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].id = i;
+        workers[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        workers[i].rate = rate / nthreads;
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    }
+    for (int elapsed = 0; running && elapsed < duration * 10; elapsed++) {
+        usleep(100000);
+    }
+    running = 0;
+
+    Histogram *total = calloc(1, sizeof(Histogram));
+    uint64_t completed = 0, errors = 0, non2xx = 0, bytes = 0, dropped = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hdr_merge(total, &workers[i].hist);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        non2xx += workers[i].non2xx;
+        bytes += workers[i].bytes;
+        dropped += workers[i].dropped;
+    }
+    double seconds = (now_us() - start) / 1e6;
+
+    if (summary) {
+        printf("%.0f %llu %llu %llu %llu %llu\n", completed / seconds,
+               (unsigned long long)hdr_percentile(total, 50), (unsigned long long)hdr_percentile(total, 99),
+               (unsigned long long)hdr_percentile(total, 99.9), (unsigned long long)total->max,
+               (unsigned long long)(errors + non2xx + dropped));
+        return 0;
+    }
+
+    printf("%s:%s, %d thread(s), %d connection(s), %s, %s\n", host, port, nthreads, nconns,
+           keep_alive ? "keep-alive" : "one request per connection",
+           rate > 0 ? "open loop" : "closed loop");
+    printf("  requests:   %llu in %.1fs (%llu errors, %llu non-2xx", (unsigned long long)completed, seconds,
+           (unsigned long long)errors, (unsigned long long)non2xx);
+    if (rate > 0) {
+        printf(", %llu not sent: generator backlog full", (unsigned long long)dropped);
+    }
+    printf(")\n");
+    printf("  throughput: %.0f req/s, %.2f MB/s\n", completed / seconds, bytes / seconds / 1e6);
+    printf("  latency:    p50 %lluus  p99 %lluus  p99.9 %lluus  max %lluus\n",
+           (unsigned long long)hdr_percentile(total, 50), (unsigned long long)hdr_percentile(total, 99),
+           (unsigned long long)hdr_percentile(total, 99.9), (unsigned long long)total->max);
+    return 0;
+}
@@ -0,0 +1,150 @@
+/* mime_gen.c
+ * Generates mime_types.h: a perfect hash from file extension to MIME type.
+ *
+ * The table below is the list of known types. The generator searches for
+ * a seed and a power-of-two table size with no two extensions in the same
+ * slot, so a lookup is one hash, one slot and one string comparison.
+ * Regenerate after editing the list:
+ *
+ *     gcc -O2 -o mime_gen mime_gen.c && ./mime_gen > mime_types.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define MAX_EXTENSION 15  // longer extensions are never looked up
+
+static const struct {
+    const char *extension;
+    const char *type;
+} types[] = {
+    { "html", "text/html; charset=utf-8" },
+    { "htm", "text/html; charset=utf-8" },
+    { "css", "text/css; charset=utf-8" },
+    { "js", "text/javascript; charset=utf-8" },
+    { "mjs", "text/javascript; charset=utf-8" },
+    { "json", "application/json" },
+    { "map", "application/json" },
+    { "webmanifest", "application/manifest+json" },
+    { "xml", "application/xml" },
+    { "txt", "text/plain; charset=utf-8" },
+    { "md", "text/markdown; charset=utf-8" },
+    { "csv", "text/csv; charset=utf-8" },
+    { "svg", "image/svg+xml" },
+    { "png", "image/png" },
+    { "jpg", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif", "image/gif" },
+    { "webp", "image/webp" },
+    { "avif", "image/avif" },
+    { "ico", "image/vnd.microsoft.icon" },
+    { "bmp", "image/bmp" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+    { "ttf", "font/ttf" },
+    { "otf", "font/otf" },
+    { "mp4", "video/mp4" },
+    { "webm", "video/webm" },
+    { "ogg", "audio/ogg" },
+    { "mp3", "audio/mpeg" },
+    { "wav", "audio/wav" },
+    { "pdf", "application/pdf" },
+    { "wasm", "application/wasm" },
+    { "zip", "application/zip" },
+    { "gz", "application/gzip" },
+    { "tar", "application/x-tar" },
+};
+#define NUM_TYPES (sizeof(types) / sizeof(types[0]))
+
+// Must match mime_hash() in the generated header
+static uint32_t hash(uint32_t seed, const char *s) {
+    uint32_t h = seed;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+int main(void) {
+    for (uint32_t size = 1; size <= 4096; size <<= 1) {
+        if (size < NUM_TYPES) {
+            continue;
+        }
+        for (uint32_t seed = 1; seed < 1000000; seed++) {
+            int slots[4096];
+            memset(slots, -1, sizeof(slots));
+            size_t i;
+            for (i = 0; i < NUM_TYPES; i++) {
+                uint32_t slot = hash(seed, types[i].extension) & (size - 1);
+                if (slots[slot] >= 0) {
+                    break;
+                }
+                slots[slot] = i;
+            }
+            if (i < NUM_TYPES) {
+                continue;
+            }
+
+            printf("/* mime_types.h\n"
+                   " * Generated by mime_gen.c; edit the list there and regenerate.\n"
+                   " *\n"
+                   " * Maps a file extension to its MIME type with a perfect hash: every\n"
+                   " * known extension has a slot of its own, so a lookup is one hash and one\n"
+                   " * comparison. Unknown extensions are application/octet-stream.\n"
+                   " */\n"
+                   "#ifndef MIME_TYPES_H\n"
+                   "#define MIME_TYPES_H\n\n"
+                   "#include <stdint.h>\n"
+                   "#include <string.h>\n\n"
+                   "#define MIME_DEFAULT \"application/octet-stream\"\n"
+                   "#define MIME_MAX_EXTENSION %d\n"
+                   "#define MIME_SEED %uu\n"
+                   "#define MIME_SLOTS %u\n\n",
+                   MAX_EXTENSION, seed, size);
+            printf("static const struct {\n"
+                   "    const char *extension;\n"
+                   "    const char *type;\n"
+                   "} mime_table[MIME_SLOTS] = {\n");
+            for (uint32_t s = 0; s < size; s++) {
+                if (slots[s] >= 0) {
+                    printf("    [%u] = { \"%s\", \"%s\" },\n", s, types[slots[s]].extension, types[slots[s]].type);
+                }
+            }
+            printf("};\n\n"
+                   "static inline uint32_t mime_hash(const char *s) {\n"
+                   "    uint32_t h = MIME_SEED;\n"
+                   "    for (; *s; s++) {\n"
+                   "        h = (h ^ (unsigned char)*s) * 16777619u;\n"
+                   "    }\n"
+                   "    return h ^ (h >> 15);\n"
+                   "}\n\n"
+                   "/* Returns the MIME type for a path from its extension, compared case\n"
+                   " * insensitively. */\n"
+                   "static inline const char *mime_type_for(const char *path) {\n"
+                   "    const char *dot = strrchr(path, '.');\n"
+                   "    if (dot == NULL || strchr(dot, '/') != NULL) {\n"
+                   "        return MIME_DEFAULT;\n"
+                   "    }\n"
+                   "    char extension[MIME_MAX_EXTENSION + 1];\n"
+                   "    size_t len = 0;\n"
+                   "    for (const char *p = dot + 1; *p; p++) {\n"
+                   "        if (len == MIME_MAX_EXTENSION) {\n"
+                   "            return MIME_DEFAULT;\n"
+                   "        }\n"
+                   "        extension[len++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;\n"
+                   "    }\n"
+                   "    extension[len] = '\\0';\n"
+                   "    uint32_t slot = mime_hash(extension) & (MIME_SLOTS - 1);\n"
+                   "    if (mime_table[slot].extension != NULL && strcmp(mime_table[slot].extension, extension) == 0) {\n"
+                   "        return mime_table[slot].type;\n"
+                   "    }\n"
+                   "    return MIME_DEFAULT;\n"
+                   "}\n\n"
+                   "#endif\n");
+            return 0;
+        }
+    }
+    fprintf(stderr, "no perfect hash found\n");
+    return 1;
+}
@@ -0,0 +1,91 @@
+/* mime_types.h
+ * Generated by mime_gen.c; edit the list there and regenerate.
+ *
+ * Maps a file extension to its MIME type with a perfect hash: every
+ * known extension has a slot of its own, so a lookup is one hash and one
+ * comparison. Unknown extensions are application/octet-stream.
+ */
+#ifndef MIME_TYPES_H
+#define MIME_TYPES_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIME_DEFAULT "application/octet-stream"
+#define MIME_MAX_EXTENSION 15
+#define MIME_SEED 27835u
+#define MIME_SLOTS 64
+
+static const struct {
+    const char *extension;
+    const char *type;
+} mime_table[MIME_SLOTS] = {
+    [1] = { "otf", "font/otf" },
+    [4] = { "html", "text/html; charset=utf-8" },
+    [5] = { "js", "text/javascript; charset=utf-8" },
+    [6] = { "css", "text/css; charset=utf-8" },
+    [10] = { "tar", "application/x-tar" },
+    [11] = { "ttf", "font/ttf" },
+    [12] = { "mjs", "text/javascript; charset=utf-8" },
+    [14] = { "jpg", "image/jpeg" },
+    [15] = { "map", "application/json" },
+    [16] = { "bmp", "image/bmp" },
+    [17] = { "mp3", "audio/mpeg" },
+    [18] = { "wav", "audio/wav" },
+    [22] = { "txt", "text/plain; charset=utf-8" },
+    [25] = { "svg", "image/svg+xml" },
+    [28] = { "ico", "image/vnd.microsoft.icon" },
+    [29] = { "webm", "video/webm" },
+    [30] = { "md", "text/markdown; charset=utf-8" },
+    [32] = { "gz", "application/gzip" },
+    [37] = { "csv", "text/csv; charset=utf-8" },
+    [39] = { "jpeg", "image/jpeg" },
+    [40] = { "mp4", "video/mp4" },
+    [41] = { "gif", "image/gif" },
+    [43] = { "ogg", "audio/ogg" },
+    [45] = { "htm", "text/html; charset=utf-8" },
+    [47] = { "json", "application/json" },
+    [48] = { "woff2", "font/woff2" },
+    [49] = { "avif", "image/avif" },
+    [52] = { "webmanifest", "application/manifest+json" },
+    [54] = { "xml", "application/xml" },
+    [55] = { "woff", "font/woff" },
+    [56] = { "wasm", "application/wasm" },
+    [57] = { "png", "image/png" },
+    [60] = { "pdf", "application/pdf" },
+    [62] = { "webp", "image/webp" },
+    [63] = { "zip", "application/zip" },
+};
+
+static inline uint32_t mime_hash(const char *s) {
+    uint32_t h = MIME_SEED;
+    for (; *s; s++) {
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    }
+    return h ^ (h >> 15);
+}
+
+/* Returns the MIME type for a path from its extension, compared case
+ * insensitively. */
+static inline const char *mime_type_for(const char *path) {
+    const char *dot = strrchr(path, '.');
+    if (dot == NULL || strchr(dot, '/') != NULL) {
+        return MIME_DEFAULT;
+    }
+    char extension[MIME_MAX_EXTENSION + 1];
+    size_t len = 0;
+    for (const char *p = dot + 1; *p; p++) {
+        if (len == MIME_MAX_EXTENSION) {
+            return MIME_DEFAULT;
+        }
+        extension[len++] = *p >= 'A' && *p <= 'Z' ? *p - 'A' + 'a' : *p;
+    }
+    extension[len] = '\0';
+    uint32_t slot = mime_hash(extension) & (MIME_SLOTS - 1);
+    if (mime_table[slot].extension != NULL && strcmp(mime_table[slot].extension, extension) == 0) {
+        return mime_table[slot].type;
+    }
+    return MIME_DEFAULT;
+}
+
+#endif
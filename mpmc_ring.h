@@ -0,0 +1,214 @@
+/* mpmc_ring.h
+ * Bounded lock-free multi-producer/multi-consumer ring of accepted
+ * connections (socket and accept time), used by server3.c to hand
+ * connections to its workers.
+ *
+ * Slots carry a sequence number so producers and consumers claim positions
+ * with a single compare-and-swap and never share a lock (Vyukov's bounded
+ * MPMC queue). When the ring is empty consumers sleep on a futex instead of
+ * spinning; when it is full the producer sleeps until a slot frees up, which
+ * pushes back on accept() rather than letting the queue grow.
+ */
+#ifndef MPMC_RING_H
+#define MPMC_RING_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define RING_SPIN 64  // tries before a thread goes to sleep
+
+typedef struct {
+    int fd;
+    uint64_t accepted_at;  // stats_now() when it was accepted
+} ring_conn;
+
+typedef struct {
+    _Atomic size_t seq;
+    ring_conn value;
+} ring_cell;
+
+typedef struct {
+    ring_cell *cells;
+    size_t mask;
+    int spin;                                // RING_SPIN, or 0 on a single CPU
+    _Alignas(64) _Atomic size_t head;        // next position to push
+    _Alignas(64) _Atomic size_t tail;        // next position to pop
+    _Alignas(64) _Atomic uint32_t items;     // futex bumped when sleepers may pop
+    _Atomic uint64_t consumers_waiting;      // see ring_announce()
+    _Alignas(64) _Atomic uint32_t space;     // futex bumped when sleepers may push
+    _Atomic uint64_t producers_waiting;
+} mpmc_ring;
+
+static inline void ring_futex_wait(_Atomic uint32_t *addr, uint32_t seen) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+
+// A thread about to sleep announces itself in a waiting word: the low 32
+// bits count the threads announced since the last wake-up, the high 32 bits
+// count wake-ups. Returns the word as of the announcement, for
+// ring_withdraw().
+static inline uint64_t ring_announce(_Atomic uint64_t *waiting) {
+    return atomic_fetch_add(waiting, 1) + 1;
+}
+
+// Takes back an announcement for a thread that found what it wanted on its
+// last check and will not sleep after all, so the next push or pop does not
+// pay for a wake-up nobody needs. Once a wake-up has cleared the count the
+// announcement is gone and the count may be other threads', so it is left
+// alone.
+static inline void ring_withdraw(_Atomic uint64_t *waiting, uint64_t announced) {
+    uint64_t cur = atomic_load(waiting);
+    while (cur >> 32 == announced >> 32 && !atomic_compare_exchange_weak(waiting, &cur, cur - 1)) {
+    }
+}
+
+// Wakes the threads that announced themselves in *waiting since the last
+// wake-up. Clearing the count means a burst of pushes (or pops) pays for
+// one FUTEX_WAKE rather than one per item; woken threads that lose the race
+// for the item simply announce themselves again. The fence orders the
+// caller's push or pop before the check, pairing with the sleeper's
+// announcement.
+static inline void ring_futex_wake(_Atomic uint32_t *addr, _Atomic uint64_t *waiting) {
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t cur = atomic_load_explicit(waiting, memory_order_relaxed);
+    while ((uint32_t)cur > 0) {
+        // Clear the count and start the next wake-up
+        if (atomic_compare_exchange_weak(waiting, &cur, (cur | UINT32_MAX) + 1)) {
+            atomic_fetch_add(addr, 1);
+            syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+            return;
+        }
+    }
+}
+
+static inline void ring_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* capacity is rounded up to a power of two. Returns -1 on allocation failure. */
+static inline int ring_init(mpmc_ring *ring, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->cells = malloc(size * sizeof(ring_cell));
+    if (ring->cells == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&ring->cells[i].seq, i);
+    }
+    ring->mask = size - 1;
+    // Spinning only helps when the other side can run at the same time
+    ring->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN : 0;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->items, 0);
+    atomic_init(&ring->consumers_waiting, 0);
+    atomic_init(&ring->space, 0);
+    atomic_init(&ring->producers_waiting, 0);
+    return 0;
+}
+
+/* Returns 0 if the ring is full. */
+static inline int ring_try_push(mpmc_ring *ring, ring_conn value) {
+    size_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring_cell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        }
+    }
+    cell->value = value;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+/* Returns 0 if the ring is empty. */
+static inline int ring_try_pop(mpmc_ring *ring, ring_conn *value) {
+    size_t pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring_cell *cell;
+    for (;;) {
+        cell = &ring->cells[pos & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    *value = cell->value;
+    atomic_store_explicit(&cell->seq, pos + ring->mask + 1, memory_order_release);
+    return 1;
+}
+
+/* Pushes value, sleeping while the ring is full. */
+static inline void ring_push(mpmc_ring *ring, ring_conn value) {
+    for (int spins = 0; ; spins++) {
+        if (ring_try_push(ring, value)) {
+            ring_futex_wake(&ring->items, &ring->consumers_waiting);
+            return;
+        }
+        if (spins < ring->spin) {
+            ring_cpu_relax();
+            continue;
+        }
+        // Announce ourselves before the last check so a consumer freeing a
+        // slot either sees us waiting or we see the slot
+        uint32_t seen = atomic_load(&ring->space);
+        uint64_t announced = ring_announce(&ring->producers_waiting);
+        if (ring_try_push(ring, value)) {
+            ring_withdraw(&ring->producers_waiting, announced);
+            ring_futex_wake(&ring->items, &ring->consumers_waiting);
+            return;
+        }
+        ring_futex_wait(&ring->space, seen);
+    }
+}
+
+/* Pops a value, sleeping while the ring is empty. */
+static inline ring_conn ring_pop(mpmc_ring *ring) {
+    ring_conn value;
+    for (int spins = 0; ; spins++) {
+        if (ring_try_pop(ring, &value)) {
+            ring_futex_wake(&ring->space, &ring->producers_waiting);
+            return value;
+        }
+        if (spins < ring->spin) {
+            ring_cpu_relax();
+            continue;
+        }
+        uint32_t seen = atomic_load(&ring->items);
+        uint64_t announced = ring_announce(&ring->consumers_waiting);
+        if (ring_try_pop(ring, &value)) {
+            ring_withdraw(&ring->consumers_waiting, announced);
+            ring_futex_wake(&ring->space, &ring->producers_waiting);
+            return value;
+        }
+        ring_futex_wait(&ring->items, seen);
+    }
+}
+
+#endif
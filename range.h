@@ -0,0 +1,123 @@
+/* range.h
+ * Range request support: parsing "Range: bytes=..." against a file size and
+ * laying out multipart/byteranges bodies.
+ *
+ * Ranges are returned as half-open [start, end) offsets, clamped to the
+ * file and in the order the client listed them. The servers stream each
+ * range with sendfile() from its offset (or slice it out of a cached body),
+ * so memory use does not depend on the file or range size.
+ */
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "http_parser.h"
+
+#define MAX_RANGES 16                           // more than this and the header is ignored
+#define RANGE_BOUNDARY "7c3a9e5f1b2d4086"        // multipart/byteranges separator
+#define RANGE_NONE 0                            // no usable Range header: send the whole file
+#define RANGE_UNSATISFIABLE (-1)                // answer 416
+
+typedef struct {
+    off_t start;
+    off_t end;   // exclusive
+} byte_range;
+
+// Parses a decimal number from [*p, end). Returns -1 if there is none.
+static inline off_t range_number(const char **p, const char *end) {
+    off_t n = -1;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        if (n > (off_t)1 << 58) {
+            return -1;  // absurdly large; treated as malformed
+        }
+        n = (n < 0 ? 0 : n * 10) + (**p - '0');
+        (*p)++;
+    }
+    return n;
+}
+
+/* Parses the request's Range header for a body of size bytes into ranges
+ * (MAX_RANGES entries). Returns the number of satisfiable ranges, RANGE_NONE
+ * when the header is absent, malformed or uses another unit (the whole file
+ * is sent, as RFC 9110 allows), or RANGE_UNSATISFIABLE. */
+static inline int http_parse_ranges(const http_request *req, off_t size, byte_range *ranges) {
+    const http_slice *value = http_get_header(req, "Range");
+    if (value == NULL || value->len < 6 || memcmp(value->ptr, "bytes=", 6) != 0) {
+        return RANGE_NONE;
+    }
+    const char *p = value->ptr + 6, *end = value->ptr + value->len;
+    int n = 0, specs = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        if (p == end) {
+            break;
+        }
+        if (++specs > MAX_RANGES) {
+            return RANGE_NONE;
+        }
+        off_t first = range_number(&p, end);
+        if (p == end || *p != '-') {
+            return RANGE_NONE;
+        }
+        p++;
+        off_t last = range_number(&p, end);
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        if (p < end && *p != ',') {
+            return RANGE_NONE;
+        }
+
+        byte_range r;
+        if (first < 0) {
+            // "-n": the last n bytes
+            if (last < 0) {
+                return RANGE_NONE;
+            }
+            if (last == 0 || size == 0) {
+                continue;
+            }
+            r.start = last < size ? size - last : 0;
+            r.end = size;
+        } else {
+            if (last >= 0 && last < first) {
+                return RANGE_NONE;
+            }
+            if (first >= size) {
+                continue;  // unsatisfiable on its own; others may still be fine
+            }
+            r.start = first;
+            r.end = last < 0 || last >= size ? size : last + 1;
+        }
+        ranges[n++] = r;
+    }
+    if (specs == 0) {
+        return RANGE_NONE;
+    }
+    return n > 0 ? n : RANGE_UNSATISFIABLE;
+}
+
+// Formats the boundary and headers that precede one part of a
+// multipart/byteranges body. Returns the length (snprintf semantics).
+static inline int range_part_header(char *buf, size_t len, const byte_range *r,
+                                    const char *content_type, off_t size) {
+    return snprintf(buf, len, "\r\n--" RANGE_BOUNDARY "\r\nContent-Type: %s\r\n"
+                              "Content-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    content_type, (long long)r->start, (long long)(r->end - 1), (long long)size);
+}
+
+#define RANGE_TRAILER "\r\n--" RANGE_BOUNDARY "--\r\n"
+#define RANGE_MULTIPART_TYPE "multipart/byteranges; boundary=" RANGE_BOUNDARY
+
+// Content-Length of the multipart/byteranges body for ranges.
+static inline off_t range_multipart_length(const byte_range *ranges, int n,
+                                           const char *content_type, off_t size) {
+    off_t total = sizeof(RANGE_TRAILER) - 1;
+    for (int i = 0; i < n; i++) {
+        total += range_part_header(NULL, 0, &ranges[i], content_type, size) + (ranges[i].end - ranges[i].start);
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,140 @@
+/* response.h
+ * Scatter-gather response builder shared by the server variants.
+ *
+ * A response is a list of iovecs. The status line and headers are formatted
+ * into a small buffer inside the builder; bodies, cached headers and other
+ * long-lived data are referenced in place rather than copied. Everything goes
+ * out with one sendmsg() per attempt, and the builder remembers how far the
+ * last attempt got, so a short write resumes where it stopped instead of
+ * truncating the response. Blocking servers call response_send_all(); the
+ * event loop calls response_send() again when the socket becomes writable.
+ *
+ * The builder points into itself, so it must not be copied once started.
+ */
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define RESPONSE_MAX_IOV 8
+#define RESPONSE_HEAD_SIZE 512  // formatted status line and headers
+
+typedef struct {
+    struct iovec iov[RESPONSE_MAX_IOV];
+    int iovcnt;
+    int next;                  // first iovec not completely sent
+    char head[RESPONSE_HEAD_SIZE];
+    size_t head_len;
+    int overflow;              // a fragment did not fit; the response is unusable
+} response;
+
+static inline void response_init(response *r) {
+    r->iovcnt = 0;
+    r->next = 0;
+    r->head_len = 0;
+    r->overflow = 0;
+}
+
+// Appends a segment by reference; it must stay valid until the response is sent.
+static inline void response_add(response *r, const void *data, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    if (r->iovcnt == RESPONSE_MAX_IOV) {
+        r->overflow = 1;
+        return;
+    }
+    r->iov[r->iovcnt].iov_base = (void *)data;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+}
+
+// Formats text into the head buffer. Consecutive formatted fragments share
+// one iovec.
+static inline void response_printf(response *r, const char *fmt, ...) {
+    size_t room = sizeof(r->head) - r->head_len;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(r->head + r->head_len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0 || (size_t)n >= room) {
+        r->overflow = 1;
+        return;
+    }
+    char *start = r->head + r->head_len;
+    r->head_len += n;
+    struct iovec *last = r->iovcnt > 0 ? &r->iov[r->iovcnt - 1] : NULL;
+    if (last != NULL && (char *)last->iov_base + last->iov_len == start) {
+        last->iov_len += n;
+    } else {
+        response_add(r, start, n);
+    }
+}
+
+// Status line plus the headers every response carries. Callers may add
+// more headers before response_end_headers().
+static inline void response_start(response *r, const char *status, const char *content_type,
+                                  off_t content_length, int keep_alive) {
+    response_printf(r, "HTTP/1.1 %s\r\nContent-Length: %lld\r\nContent-Type: %s\r\nConnection: %s\r\n",
+                    status, (long long)content_length, content_type,
+                    keep_alive ? "keep-alive" : "close");
+}
+
+static inline void response_end_headers(response *r) {
+    response_printf(r, "\r\n");
+}
+
+// Bytes not yet sent
+static inline size_t response_remaining(const response *r) {
+    size_t n = 0;
+    for (int i = r->next; i < r->iovcnt; i++) {
+        n += r->iov[i].iov_len;
+    }
+    return n;
+}
+
+/* Sends as much as the socket accepts. Returns 1 once everything is out, 0
+ * when the socket would block and -1 on errors. With more set the kernel
+ * is told further data follows (a sendfile() body), so the header is not
+ * pushed out in a packet of its own. */
+static inline int response_send(response *r, int fd, int more) {
+    if (r->overflow) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    while (r->next < r->iovcnt) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &r->iov[r->next];
+        msg.msg_iovlen = r->iovcnt - r->next;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        // Drop what went out, trimming a partially sent iovec
+        while (r->next < r->iovcnt && (size_t)n >= r->iov[r->next].iov_len) {
+            n -= r->iov[r->next].iov_len;
+            r->next++;
+        }
+        if (r->next < r->iovcnt) {
+            r->iov[r->next].iov_base = (char *)r->iov[r->next].iov_base + n;
+            r->iov[r->next].iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+// For blocking sockets. Returns 0 once everything is sent, -1 on errors.
+static inline int response_send_all(response *r, int fd, int more) {
+    return response_send(r, fd, more) == 1 ? 0 : -1;
+}
+
+#endif
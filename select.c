@@ -1,162 +1,671 @@
 /* *******select.c*********
- *******Using select() for I/O multiplexing */
+ * Chat relay: whatever a client sends is forwarded to every other client.
+ *
+ * Despite the name it runs on epoll, so a message costs one write per
+ * receiver rather than a scan over every descriptor, and nothing ever
+ * blocks on a single client:
+ *
+ *  - a message is stored once, in a ring shared by all receivers, and
+ *    counts the receivers that still have to send it; the last one frees it;
+ *  - each client keeps a cursor into the ring (and an offset into a message
+ *    it sent partway), so a receiver that is behind simply resumes from its
+ *    cursor once its socket drains;
+ *  - all writes are non-blocking: messages received in one pass of the
+ *    loop are written out after it, and a client whose socket is full waits
+ *    for EPOLLOUT without holding up the others;
+ *  - a client that falls RING_SIZE messages behind is dropped, which bounds
+ *    the memory a slow reader can pin;
+ *  - whatever a client has pending goes out in one sendmsg() per pass of
+ *    the loop, gathered straight from the ring, so a burst of messages
+ *    costs each receiver one syscall rather than one per message.
+ *
+ * By default a message is whatever one read returns, so the stream has no
+ * boundaries. With -f the relay speaks length-prefixed frames instead: a
+ * 4-byte big-endian payload length, then the payload. Every complete frame
+ * becomes a message of its own, a partial one waits in the client's input
+ * buffer for the rest, and receivers get the frames exactly as sent.
+ *
+ * With -t the relay runs as that many shards, one thread each (0: one per
+ * CPU). Each shard is a relay of its own, with a listening socket bound
+ * with SO_REUSEPORT so the kernel spreads clients between them, like the
+ * reactors of server4.c. A message a shard receives goes into its own ring
+ * and, once, into a parcel handed to every other shard through a lock-free
+ * single-producer/single-consumer queue per pair of shards, plus a write to
+ * the receiving shard's eventfd at the end of the loop pass. Each shard then
+ * fans the parcel out to its own clients, so the writes to receivers are
+ * spread over all the threads. A client's messages travel through one
+ * queue to each shard, so every receiver gets them in the order they were
+ * sent. When a queue is full the sender's shard drains its own queues while
+ * it waits, so two shards flooding each other cannot deadlock, and a shard
+ * that falls behind slows the others down instead of growing a backlog.
+ *
+ * Usage: select [-f] [-t shards] [port]
+ */
+#define _GNU_SOURCE  // accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <sys/select.h>
+
+#include "spsc_ring.h"
+
 /* port we're listening on */
 #define PORT 2020
- 
-int main(int argc, char *argv[])
-{
-    /* master file descriptor list */
-    fd_set master;
-    /* temp file descriptor list for select() */
-    fd_set read_fds;
-    /* server address */
-    struct sockaddr_in serveraddr;
-    /* client address */
-    struct sockaddr_in clientaddr;
-    /* maximum file descriptor number */
-    int fdmax;
-    /* listening socket descriptor */
-    int listener;
-    /* newly accept()ed socket descriptor */
-    int newfd;
-    /* buffer for client data */
-    char buf[1024];
-    int nbytes;
+#define MAX_EVENTS 1024
+#define READ_SIZE 16384     // bytes taken from a client per read; a message of its own unless framed
+#define RING_SIZE 4096      // messages a client may fall behind before it is dropped; a power of two
+#define WRITE_BATCH 64      // messages gathered into one sendmsg()
+#define FRAME_HEADER 4      // big-endian payload length ahead of each frame
+#define MAX_FRAME 65536     // largest payload accepted in framed mode
+#define SHARD_QUEUE 4096    // parcels in flight from one shard to another
+
+typedef struct message {
+    int refs;               // receivers that have not sent it yet
+    uint64_t seq;           // position in the stream of messages
+    uint64_t sender;        // id of the client it came from, which does not get it back
+    size_t len;
+    char data[];
+} message;
+
+typedef struct client {
+    int fd;
+    uint64_t id;
+    uint64_t cursor;        // seq of the next message to send
+    size_t offset;          // bytes of that message already sent
+    int blocked;            // socket full: waiting for EPOLLOUT
+    int dead;               // dropped; freed at the end of the loop pass
+    char *in;               // framed mode: start of a frame still arriving, or NULL
+    size_t in_len;
+    struct client *prev, *next;
+} client;
+
+// A message on its way from one shard to the others, which each copy it
+// into their own ring; the last one frees it.
+typedef struct {
+    _Atomic int refs;       // shards that have not taken it yet
+    uint64_t sender;
+    size_t len;
+    char data[];
+} parcel;
+
+typedef struct relay {
+    int listen_fd;
+    int epoll_fd;
+    message *ring[RING_SIZE];  // message seq lives in slot seq % RING_SIZE until sent to all
+    uint64_t head;             // seq of the next message
+    uint64_t flushed;          // head when receivers were last written to
+    client *clients;           // connected clients
+    int nclients;
+    client *graveyard;         // dropped during this pass, linked through next
+    uint64_t next_id;
+    int framed;                // -f: messages are length-prefixed frames
+
+    // Sharding (-t): this shard is shards[index] of nshards
+    struct relay *shards;
+    int index;
+    int nshards;
+    spsc_ring *inbox;          // inbox[i]: parcels from shard i; unused for index
+    int wake_fd;               // eventfd the other shards write after filling the inbox
+    char *wake;                // wake[i]: parcels were sent to shard i during this pass
+    pthread_t thread;
+} relay;
+
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+// The message at seq if the client still has it to send. Its own messages
+// may already be gone: it holds no reference to them.
+message *ring_at(relay *r, uint64_t seq) {
+    message *m = r->ring[seq & (RING_SIZE - 1)];
+    return m != NULL && m->seq == seq ? m : NULL;
+}
+
+void message_unref(relay *r, message *m) {
+    if (--m->refs == 0) {
+        r->ring[m->seq & (RING_SIZE - 1)] = NULL;
+        free(m);
+    }
+}
+
+// Takes the client out of the relay: it gives up its references to the
+// messages it has not sent and its descriptor is closed. The memory stays
+// until the end of the loop pass, as events for it may still be pending.
+void client_drop(relay *r, client *c, const char *why) {
+    if (c->dead) {
+        return;
+    }
+    for (uint64_t seq = c->cursor; seq < r->head; seq++) {
+        message *m = ring_at(r, seq);
+        if (m != NULL && m->sender != c->id) {
+            message_unref(r, m);
+        }
+    }
+    if (why != NULL) {
+        printf("socket %d dropped: %s\n", c->fd, why);
+    }
+    close(c->fd);  // also removes it from the epoll set
+    c->dead = 1;
+    if (c->prev) c->prev->next = c->next; else r->clients = c->next;
+    if (c->next) c->next->prev = c->prev;
+    r->nclients--;
+    c->next = r->graveyard;
+    r->graveyard = c;
+}
+
+void set_blocked(relay *r, client *c, int blocked) {
+    if (c->blocked == blocked) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | (blocked ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("ERROR updating epoll interest");
+        client_drop(r, c, "epoll failure");
+        return;
+    }
+    c->blocked = blocked;
+}
+
+// Writes the client what it has not sent yet, as far as its socket takes
+// it, and waits for EPOLLOUT if it fills up. Pending messages are gathered
+// WRITE_BATCH at a time into one sendmsg().
+void client_flush(relay *r, client *c) {
+    while (c->cursor < r->head) {
+        struct iovec iov[WRITE_BATCH];
+        message *batch[WRITE_BATCH];
+        int count = 0;
+        for (uint64_t seq = c->cursor; seq < r->head && count < WRITE_BATCH; seq++) {
+            message *m = ring_at(r, seq);
+            if (m == NULL || m->sender == c->id) {
+                continue;  // its own message
+            }
+            size_t skip = count == 0 ? c->offset : 0;
+            iov[count].iov_base = m->data + skip;
+            iov[count].iov_len = m->len - skip;
+            batch[count++] = m;
+        }
+        if (count == 0) {
+            c->cursor = r->head;  // nothing but its own
+            break;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                set_blocked(r, c, 1);
+                return;
+            }
+            client_drop(r, c, strerror(errno));
+            return;
+        }
+
+        // Let go of the messages that went out whole; the cursor stops at
+        // the first one that did not
+        for (int i = 0; i < count; i++) {
+            if ((size_t)n < iov[i].iov_len) {
+                c->cursor = batch[i]->seq;
+                c->offset += n;
+                break;
+            }
+            n -= iov[i].iov_len;
+            c->offset = 0;
+            c->cursor = batch[i]->seq + 1;
+            message_unref(r, batch[i]);
+        }
+    }
+    set_blocked(r, c, 0);
+}
+
+// Adds a message to the ring for the clients of this shard, except its
+// sender when that is one of them (from, NULL for a message from another shard).
+void publish_local(relay *r, client *from, uint64_t sender, const char *data, size_t len) {
+    // A dropped sender is no longer counted in nclients
+    if (r->nclients - (from != NULL && !from->dead) < 1) {
+        return;  // nobody to hear it
+    }
+    uint64_t seq = r->head;
+    if (r->ring[seq & (RING_SIZE - 1)] != NULL) {
+        // Someone still has the message RING_SIZE back to send: drop
+        // whoever is that far behind to free the slot
+        for (client *c = r->clients, *next; c != NULL; c = next) {
+            next = c->next;
+            if (c->cursor + RING_SIZE <= seq) {
+                client_drop(r, c, "too far behind");
+            }
+        }
+    }
+
+    message *m = malloc(sizeof(message) + len);
+    if (m == NULL) {
+        perror("ERROR allocating message");
+        return;
+    }
+    m->refs = r->nclients - (from != NULL && !from->dead);
+    m->seq = seq;
+    m->sender = sender;
+    m->len = len;
+    memcpy(m->data, data, len);
+    if (m->refs == 0) {
+        free(m);
+        return;
+    }
+    r->ring[seq & (RING_SIZE - 1)] = m;
+    r->head++;
+}
+
+void wake_shard(relay *shard) {
+    uint64_t one = 1;
+    if (write(shard->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("ERROR waking shard");
+    }
+}
+
+// Publishes what the other shards have sent this one.
+void drain_inbox(relay *r) {
+    for (int i = 0; i < r->nshards; i++) {
+        if (i == r->index) {
+            continue;
+        }
+        parcel *p;
+        while ((p = spsc_pop(&r->inbox[i])) != NULL) {
+            publish_local(r, NULL, p->sender, p->data, p->len);
+            if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) == 1) {
+                free(p);
+            }
+        }
+    }
+}
+
+// Hands a message to every other shard. A full queue is waited out, taking
+// in what the other shards send meanwhile so they can make progress too.
+void forward(relay *r, uint64_t sender, const char *data, size_t len) {
+    parcel *p = malloc(sizeof(parcel) + len);
+    if (p == NULL) {
+        perror("ERROR allocating parcel");
+        return;
+    }
+    atomic_init(&p->refs, r->nshards - 1);
+    p->sender = sender;
+    p->len = len;
+    memcpy(p->data, data, len);
+
+    for (int i = 0; i < r->nshards; i++) {
+        if (i == r->index) {
+            continue;
+        }
+        relay *shard = &r->shards[i];
+        while (!spsc_push(&shard->inbox[r->index], p)) {
+            wake_shard(shard);
+            drain_inbox(r);
+            sched_yield();
+        }
+        r->wake[i] = 1;
+    }
+}
+
+// Adds a message from a client for everyone else, on every shard.
+void publish(relay *r, client *from, const char *data, size_t len) {
+    publish_local(r, from, from->id, data, len);
+    if (r->nshards > 1) {
+        forward(r, from->id, data, len);
+    }
+}
+
+static size_t frame_size(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return FRAME_HEADER + ((size_t)u[0] << 24 | (size_t)u[1] << 16 | (size_t)u[2] << 8 | u[3]);
+}
+
+// Publishes each complete frame in data. Returns the bytes used, which
+// leaves a partial frame at the end, or -1 on a frame over MAX_FRAME.
+ssize_t publish_frames(relay *r, client *c, const char *data, size_t len) {
+    size_t used = 0;
+    while (len - used >= FRAME_HEADER) {
+        size_t size = frame_size(data + used);
+        if (size > FRAME_HEADER + MAX_FRAME) {
+            return -1;
+        }
+        if (len - used < size) {
+            break;
+        }
+        publish(r, c, data + used, size);
+        used += size;
+    }
+    return used;
+}
+
+// Takes one read's worth of frames from the client. Reads go to the stack
+// while the client is between frames, and to its input buffer, which
+// holds a whole frame, while one is only partly in.
+int read_frames(relay *r, client *c) {
+    char buf[READ_SIZE];
+    char *data = buf;
+    size_t room = sizeof(buf);
+    if (c->in != NULL) {
+        data = c->in;
+        room = FRAME_HEADER + MAX_FRAME - c->in_len;
+    }
+    ssize_t nbytes = recv(c->fd, data + c->in_len, room, 0);
+    if (nbytes <= 0) {
+        return nbytes;
+    }
+    size_t len = c->in_len + nbytes;
+    ssize_t used = publish_frames(r, c, data, len);
+    if (used < 0) {
+        client_drop(r, c, "frame too large");
+        return 1;
+    }
+
+    size_t left = len - used;
+    if (left == 0) {
+        free(c->in);
+        c->in = NULL;
+    } else if (c->in == NULL) {
+        if ((c->in = malloc(FRAME_HEADER + MAX_FRAME)) == NULL) {
+            perror("ERROR allocating input buffer");
+            client_drop(r, c, NULL);
+            return 1;
+        }
+        memcpy(c->in, data + used, left);
+    } else {
+        memmove(c->in, data + used, left);
+    }
+    c->in_len = left;
+    return 1;
+}
+
+// Writes out what this pass of the loop received. Blocked clients are left
+// to their EPOLLOUT.
+void flush_all(relay *r) {
+    if (r->flushed == r->head) {
+        return;
+    }
+    for (client *c = r->clients, *next; c != NULL; c = next) {
+        next = c->next;
+        if (!c->blocked) {
+            client_flush(r, c);
+        }
+    }
+    r->flushed = r->head;
+}
+
+void accept_clients(relay *r) {
+    char client_ip[INET_ADDRSTRLEN];  // inet_ntoa's static buffer would be shared by the shards
+    while (1) {
+        struct sockaddr_in clientaddr;
+        socklen_t addrlen = sizeof(clientaddr);
+        int newfd = accept4(r->listen_fd, (struct sockaddr *)&clientaddr, &addrlen, SOCK_NONBLOCK);
+        if (newfd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("Server-accept() error lol!");
+            }
+            return;
+        }
+
+        client *c = calloc(1, sizeof(client));
+        if (c == NULL) {
+            perror("ERROR allocating client");
+            close(newfd);
+            continue;
+        }
+        c->fd = newfd;
+        c->id = ++r->next_id * r->nshards + r->index;  // unique across shards
+        c->cursor = r->head;  // no history: it hears what is said from now on
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, newfd, &ev) < 0) {
+            perror("ERROR adding client to epoll");
+            close(newfd);
+            free(c);
+            continue;
+        }
+        c->next = r->clients;
+        if (r->clients) r->clients->prev = c;
+        r->clients = c;
+        r->nclients++;
+        inet_ntop(AF_INET, &clientaddr.sin_addr, client_ip, sizeof(client_ip));
+        printf("New connection from %s on socket %d\n", client_ip, newfd);
+    }
+}
+
+// Takes one read's worth from the client; reads are level-triggered, so a
+// client that sends a lot cannot starve the others.
+void read_client(relay *r, client *c) {
+    char buf[READ_SIZE];
+    ssize_t nbytes;
+    if (r->framed) {
+        nbytes = read_frames(r, c);
+    } else if ((nbytes = recv(c->fd, buf, sizeof(buf), 0)) > 0) {
+        publish(r, c, buf, nbytes);
+    }
+    if (nbytes > 0) {
+        return;
+    } else if (nbytes == 0) {
+        printf("socket %d hung up\n", c->fd);
+        client_drop(r, c, NULL);
+    } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recv() error lol!");
+        client_drop(r, c, NULL);
+    }
+}
+
+// Creates a non-blocking listening socket. With reuseport the socket of
+// every shard binds the same port and the kernel balances clients.
+int create_listener(int port, int reuseport) {
     /* for setsockopt() SO_REUSEADDR, below */
     int yes = 1;
-    int addrlen;
-    int i, j;
-    /* clear the master and temp sets */
-    FD_ZERO(&master);
-    FD_ZERO(&read_fds);
+    struct sockaddr_in serveraddr;
+    int listener;
 
     /* get the listener */
-    if((listener = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+    if((listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
     {
         perror("Server-socket() error lol!");
-        /*just exit lol!*/
-        exit(1);
+        return -1;
     }
-    printf("Server-socket() is OK...\n");
     /*"address already in use" error message */
-    if(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1)
+    if(setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+       (reuseport && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1))
     {
         perror("Server-setsockopt() error lol!");
-        exit(1);
+        close(listener);
+        return -1;
     }
-    printf("Server-setsockopt() is OK...\n");
 
     /* bind */
+    memset(&serveraddr, 0, sizeof(serveraddr));
     serveraddr.sin_family = AF_INET;
     serveraddr.sin_addr.s_addr = INADDR_ANY;
-    serveraddr.sin_port = htons(PORT);
-    memset(&(serveraddr.sin_zero), '\0', 8);
+    serveraddr.sin_port = htons(port);
 
     if(bind(listener, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) == -1)
     {
         perror("Server-bind() error lol!");
-        exit(1);
+        close(listener);
+        return -1;
     }
-    printf("Server-bind() is OK...\n");
 
     /* listen */
-    if(listen(listener, 10) == -1)
+    if(listen(listener, SOMAXCONN) == -1)
     {
         perror("Server-listen() error lol!");
-        exit(1);
+        close(listener);
+        return -1;
     }
-    printf("Server-listen() is OK...\n");
+    return listener;
+}
 
-    /* add the listener to the master set */
-    FD_SET(listener, &master);
-    /* keep track of the biggest file descriptor */
-    fdmax = listener; /* so far, it's this one*/
+void *relay_run(void *arg) {
+    relay *r = arg;
 
     /* loop */
+    struct epoll_event events[MAX_EVENTS];
     for(;;)
     {
-        /* copy it */
-        read_fds = master;
-
-        if(select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1)
-        {
-            perror("Server-select() error lol!");
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ERROR in epoll_wait");
             exit(1);
         }
-        printf("Server-select() is OK...\n");
-
-        /*run through the existing connections looking for data to be read*/
-        for(i = 0; i <= fdmax; i++)
-        {
-            if(FD_ISSET(i, &read_fds))
-            { /* we got one... */
-                if(i == listener)
-                {
-                    /* handle new connections */
-                    addrlen = sizeof(clientaddr);
-                    if((newfd = accept(listener, (struct sockaddr *)&clientaddr, &addrlen)) == -1)
-                    {
-                        perror("Server-accept() error lol!");
-                    }
-                    else
-                    {
-                        printf("Server-accept() is OK...\n");
-
-                        FD_SET(newfd, &master); /* add to master set */
-                        if(newfd > fdmax)
-                        { /* keep track of the maximum */
-                            fdmax = newfd;
-                        }
-                        printf("%s: New connection from %s on socket %d\n", argv[0], inet_ntoa(clientaddr.sin_addr), newfd);
-                    }
-                }
-                else
-                {
-                    /* handle data from a client */
-                    if((nbytes = recv(i, buf, sizeof(buf), 0)) <= 0)
-                    {
-                        /* got error or connection closed by client */
-                        if(nbytes == 0)
-                            /* connection closed */
-                            printf("%s: socket %d hung up\n", argv[0], i);
-
-                        else
-                            perror("recv() error lol!");
-
-                        /* close it... */
-                        close(i);
-                        /* remove from master set */
-                        FD_CLR(i, &master);
-                    }
-                    else
-                    {
-                        /* we got some data from a client*/
-                        for(j = 0; j <= fdmax; j++)
-                        {
-                            /* send to everyone! */
-                            if(FD_ISSET(j, &master))
-                            {
-                                /* except the listener and ourselves */
-                                if(j != listener && j != i)
-                                {
-                                    if(send(j, buf, nbytes, 0) == -1)
-                                        perror("send() error lol!");
-                                }
-                            }
-                        }
-                    }
+
+        for (int i = 0; i < n; i++) {
+            client *c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_clients(r);
+                continue;
+            }
+            if ((void *)c == r) {
+                // Parcels from other shards
+                uint64_t count;
+                if (read(r->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                    perror("ERROR reading eventfd");
                 }
+                drain_inbox(r);
+                continue;
+            }
+            if (c->dead) {
+                continue;
             }
+            if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+                client_flush(r, c);
+            }
+            if (!c->dead && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                read_client(r, c);
+            }
+        }
+
+        flush_all(r);
+        for (int i = 0; i < r->nshards; i++) {
+            if (r->wake[i]) {
+                r->wake[i] = 0;
+                wake_shard(&r->shards[i]);
+            }
+        }
+        while (r->graveyard != NULL) {
+            client *c = r->graveyard;
+            r->graveyard = c->next;
+            free(c->in);
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    int framed = 0;
+    int nshards = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "ft:")) != -1) {
+        switch (opt) {
+        case 'f': framed = 1; break;
+        case 't': nshards = atoi(optarg); break;
+        default:
+            fprintf(stderr, "Usage: %s [-f] [-t shards] [port]\n", argv[0]);
+            exit(1);
+        }
+    }
+    int port = optind < argc ? atoi(argv[optind]) : PORT;
+    if (nshards <= 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nshards = ncpus > 0 ? ncpus : 1;
+    }
+
+    raise_fd_limit();
+    signal(SIGPIPE, SIG_IGN);
+
+    relay *shards = calloc(nshards, sizeof(relay));
+    if (shards == NULL) {
+        perror("ERROR allocating relay");
+        exit(1);
+    }
+
+    for (int i = 0; i < nshards; i++) {
+        relay *r = &shards[i];
+        r->framed = framed;
+        r->shards = shards;
+        r->index = i;
+        r->nshards = nshards;
+        r->inbox = calloc(nshards, sizeof(spsc_ring));
+        r->wake = calloc(nshards, 1);
+        if (r->inbox == NULL || r->wake == NULL) {
+            perror("ERROR allocating shard queues");
+            exit(1);
+        }
+        for (int j = 0; j < nshards; j++) {
+            if (j != i && spsc_init(&r->inbox[j], SHARD_QUEUE) < 0) {
+                perror("ERROR allocating shard queues");
+                exit(1);
+            }
+        }
+
+        if ((r->listen_fd = create_listener(port, nshards > 1)) < 0) {
+            exit(1);
+        }
+        if ((r->epoll_fd = epoll_create1(0)) < 0) {
+            perror("ERROR creating epoll instance");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;  // the listener
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+            perror("ERROR adding listener to epoll");
+            exit(1);
+        }
+
+        // The eventfd is tagged with the shard itself
+        ev.data.ptr = r;
+        if ((r->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wake_fd, &ev) < 0) {
+            perror("ERROR creating shard eventfd");
+            exit(1);
+        }
+    }
+    printf("Relay listening on port %d%s (%d shard%s)\n", port, framed ? ", framed" : "",
+           nshards, nshards > 1 ? "s" : "");
+
+    // The main thread runs the first shard itself
+    for (int i = 1; i < nshards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, relay_run, &shards[i]) != 0) {
+            perror("ERROR creating shard thread");
+            exit(1);
         }
     }
+    relay_run(&shards[0]);
     return 0;
 }
@@ -7,91 +7,345 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include "http_parser.h"
+#include "docroot.h"
+#include "file_cache.h"
+#include "response.h"
+#include "range.h"
+#include "conditional.h"
+#include "stats.h"
+#include "admission.h"
+
+#define KEEPALIVE_TIMEOUT 5    // seconds an idle connection is kept open
+#define KEEPALIVE_MAX 100      // requests served before the connection is closed
+#define HEADER_TIMEOUT 10      // seconds to finish a request head once it has begun
+#define WRITE_TIMEOUT 10       // seconds a write may wait without the client reading any of it
 
 char *ROOT;  // Diretório raiz para os arquivos
+docroot_index docroot;  // files of ROOT resolved so far
+file_cache cache;       // small files kept in memory between requests
 
 void error(const char *msg) {
     perror(msg);
     exit(1);
 }
 
-void send_response(int newsockfd, const char *status, const char *content_type, const char *body) {
-    char response[4096];
-    sprintf(response, "HTTP/1.1 %s\r\nContent-Length: %ld\r\nContent-Type: %s\r\nConnection: Closed\r\n\r\n%s",
-            status, strlen(body), content_type, body);
-    write(newsockfd, response, strlen(response));
+// Sends a small in-memory response; returns keep_alive, or 0 if the write failed.
+int send_response(int newsockfd, const char *status, const char *content_type, const char *body,
+                  int keep_alive) {
+    stats_status(status);
+    response r;
+    response_init(&r);
+    response_start(&r, status, content_type, strlen(body), keep_alive);
+    response_end_headers(&r);
+    response_add(&r, body, strlen(body));
+    if (response_send_all(&r, newsockfd, 0) < 0) {
+        return 0;
+    }
+    return keep_alive;
+}
+
+// Sends a cached file: pre-rendered header, Connection header and body in one sendmsg().
+int send_cached(int newsockfd, const cache_entry *cached, int keep_alive) {
+    stats_status("200 OK");
+    response r;
+    response_init(&r);
+    response_add(&r, cached->header, cached->header_len);
+    response_printf(&r, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    response_add(&r, cached->data, cached->size);
+    return response_send_all(&r, newsockfd, 0);
 }
 
-void handle_request(int newsockfd) {
-    char buffer[2048];
-    int n = read(newsockfd, buffer, sizeof(buffer) - 1);
-    if (n < 0) error("ERROR reading from socket");
-    buffer[n] = '\0';
+// Tells a revalidating client its copy is still current.
+int send_not_modified(int newsockfd, const http_validators *validators, const char *content_type,
+                      int keep_alive) {
+    stats_status("304 Not Modified");
+    response r;
+    response_init(&r);
+    response_not_modified(&r, validators, content_type, keep_alive);
+    return response_send_all(&r, newsockfd, 0) < 0 ? 0 : keep_alive;
+}
 
-    // Parse the request line
-    char method[16], path[256], protocol[16];
-    sscanf(buffer, "%s %s %s", method, path, protocol);
+// Streams len bytes of the file from offset straight from the page cache
+// to the socket.
+int send_file(int newsockfd, int filefd, off_t offset, off_t len) {
+    off_t end = offset + len;
+    while (offset < end) {
+        ssize_t n = sendfile(newsockfd, filefd, &offset, end - offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;  // file shrank underneath us
+    }
+    return 0;
+}
 
-    // Only handle GET requests
-    if (strcmp(method, "GET") != 0) {
-        send_response(newsockfd, "405 Method Not Allowed", "text/plain", "Method Not Allowed");
-        return;
+// Answers a Range request from a cached body (data) or from filefd: one
+// range as a plain 206, several as multipart/byteranges and none that is
+// satisfiable as 416. Returns keep_alive, or 0 if the write failed.
+int send_ranges(int newsockfd, const byte_range *ranges, int nranges, const char *data, int filefd,
+                off_t size, const char *content_type, const http_validators *validators, int keep_alive) {
+    response r;
+    response_init(&r);
+    if (nranges == RANGE_UNSATISFIABLE) {
+        stats_status("416 Range Not Satisfiable");
+        response_start(&r, "416 Range Not Satisfiable", "text/plain", 0, keep_alive);
+        response_printf(&r, "Content-Range: bytes */%lld\r\n", (long long)size);
+        response_end_headers(&r);
+        return response_send_all(&r, newsockfd, 0) < 0 ? 0 : keep_alive;
     }
 
-    // Construct the file path
-    char filepath[512];
-    if (strcmp(path, "/") == 0) {
-        snprintf(filepath, sizeof(filepath), "%s/index.html", ROOT);
+    stats_status("206 Partial Content");
+    if (nranges == 1) {
+        response_start(&r, "206 Partial Content", content_type, ranges[0].end - ranges[0].start, keep_alive);
+        response_printf(&r, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].start,
+                        (long long)ranges[0].end - 1, (long long)size);
     } else {
-        snprintf(filepath, sizeof(filepath), "%s%s", ROOT, path);
+        response_start(&r, "206 Partial Content", RANGE_MULTIPART_TYPE,
+                       range_multipart_length(ranges, nranges, content_type, size), keep_alive);
+    }
+    response_validators(&r, validators);
+    response_end_headers(&r);
+
+    // Something always follows the last piece, except for a single range
+    // served from memory
+    int more = data == NULL || nranges > 1;
+    for (int i = 0; i < nranges; i++) {
+        char part[256];
+        if (nranges > 1) {
+            response_add(&r, part, range_part_header(part, sizeof(part), &ranges[i], content_type, size));
+        }
+        off_t len = ranges[i].end - ranges[i].start;
+        if (data != NULL) {
+            response_add(&r, data + ranges[i].start, len);
+        }
+        if (response_send_all(&r, newsockfd, more) < 0 ||
+            (data == NULL && send_file(newsockfd, filefd, ranges[i].start, len) < 0)) {
+            perror("ERROR sending file");
+            return 0;
+        }
+        response_init(&r);
+    }
+    if (nranges > 1) {
+        response_add(&r, RANGE_TRAILER, sizeof(RANGE_TRAILER) - 1);
+        if (response_send_all(&r, newsockfd, 0) < 0) {
+            return 0;
+        }
+    }
+    return keep_alive;
+}
+
+// Small files are served from memory, compressed when the client accepts
+// it; ranges always refer to the uncompressed file. Files too large to cache
+// only go through the cache for a precompressed sibling. Returns NULL when
+// the file is to be sent from disk.
+cache_entry *fetch_cached(const http_request *req, const docroot_entry *file) {
+    int accepted = http_get_header(req, "Range") == NULL ? accepted_encodings(req) : 0;
+    if (!file_cache_eligible(file->st.st_size, file->content_type, accepted)) {
+        return NULL;  // sent from disk without asking the cache
+    }
+    cache_entry *cached = file_cache_get_encoded(&cache, file->path, file->content_type, accepted);
+    stats_count(cached != NULL ? STATS_CACHE_HITS : STATS_CACHE_MISSES);
+    return cached;
+}
+
+// Serves a file from the cache; returns whether the connection stays open.
+// Revalidations are answered from the cached validators.
+int serve_cached(int newsockfd, const http_request *req, const cache_entry *cached, int keep_alive) {
+    const http_validators *validators = &cached->validators;
+    byte_range ranges[MAX_RANGES];
+    int nranges = http_range_applies(req, validators) ? http_parse_ranges(req, cached->size, ranges) : RANGE_NONE;
+    if (http_not_modified(req, validators)) {
+        return send_not_modified(newsockfd, validators, cached->content_type, keep_alive);
+    }
+    if (nranges != RANGE_NONE) {
+        return send_ranges(newsockfd, ranges, nranges, cached->data, -1, cached->size,
+                           cached->content_type, validators, keep_alive);
+    }
+    if (send_cached(newsockfd, cached, keep_alive) < 0) {
+        perror("ERROR sending file");
+        return 0;
+    }
+    return keep_alive;
+}
+
+// Serves a file of the document root from disk; returns whether the
+// connection stays open.
+int serve_file(int newsockfd, const http_request *req, const docroot_entry *file, int keep_alive) {
+    // The index already holds the stat data, so revalidations are answered
+    // without touching the file
+    byte_range ranges[MAX_RANGES];
+    int nranges;
+    off_t size = file->st.st_size;
+    http_validators validators;
+    http_validators_init(&validators, &file->st.st_mtim, size, NULL);
+    if (http_not_modified(req, &validators)) {
+        return send_not_modified(newsockfd, &validators, file->content_type, keep_alive);
+    }
+
+    nranges = http_range_applies(req, &validators) ? http_parse_ranges(req, size, ranges) : RANGE_NONE;
+    if (nranges != RANGE_NONE) {
+        return send_ranges(newsockfd, ranges, nranges, NULL, file->fd, size, file->content_type,
+                           &validators, keep_alive);
     }
 
-    // Check if the path is a directory
-    struct stat path_stat;
-    stat(filepath, &path_stat);
-    if (S_ISDIR(path_stat.st_mode)) {
-        send_response(newsockfd, "403 Forbidden", "text/plain", "Forbidden: Is a directory");
-        return;
+    // Send the header, then the body without copying it through userspace;
+    // MSG_MORE lets the header share a packet with the start of the body
+    stats_status("200 OK");
+    response r;
+    response_init(&r);
+    response_start(&r, "200 OK", file->content_type, size, keep_alive);
+    response_printf(&r, "Accept-Ranges: bytes\r\n");
+    response_validators(&r, &validators);
+    response_end_headers(&r);
+    if (response_send_all(&r, newsockfd, size > 0) < 0 || send_file(newsockfd, file->fd, 0, size) < 0) {
+        perror("ERROR sending file");
+        keep_alive = 0;
     }
+    return keep_alive;
+}
+
+// Answers one parsed request; returns whether the connection stays open.
+// accepted_at is when the connection was accepted, for the first request.
+int handle_request(int newsockfd, const http_request *req, int served, uint64_t accepted_at) {
+    int keep_alive = served < KEEPALIVE_MAX && http_wants_keep_alive(req);
 
-    // Open the file
-    int filefd = open(filepath, O_RDONLY);
-    if (filefd < 0) {
-        perror("ERROR opening file");
-        send_response(newsockfd, "404 Not Found", "text/plain", "File Not Found");
-        return;
+    // Only handle GET requests; a request body would desync the stream
+    if (!http_slice_eq(req->method, "GET")) {
+        return send_response(newsockfd, "405 Method Not Allowed", "text/plain", "Method Not Allowed", 0);
     }
 
-    // Get the file size
-    struct stat filestat;
-    if (fstat(filefd, &filestat) < 0) {
-        perror("ERROR getting file size");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        close(filefd);
-        return;
+    int format = stats_requested(req->path);
+    if (format != 0) {
+        size_t len;
+        char *body = stats_render(format, &len);
+        if (body == NULL) {
+            return send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error", 0);
+        }
+        keep_alive = send_response(newsockfd, "200 OK", "text/plain; charset=utf-8", body, keep_alive);
+        free(body);
+        return keep_alive;
+    }
+
+    // Resolve the path beneath the document root; ".." and symlinks that
+    // lead out of it are not found
+    uint64_t start = stats_now();
+    docroot_entry *file = docroot_lookup(&docroot, req->path.ptr, req->path.len);
+    int lookup_errno = errno;
+    cache_entry *cached = NULL;
+    if (file != NULL) {
+        cached = fetch_cached(req, file);
+    }
+    stats_stage_end(STATS_FILE, &start);
+    if (served == 0) {
+        stats_record(STATS_FIRST_BYTE, start - accepted_at);
     }
 
-    // Read the file content
-    char *filecontent = malloc(filestat.st_size);
-    if (filecontent == NULL) {
-        perror("ERROR allocating memory");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        close(filefd);
-        return;
+    if (file == NULL) {
+        if (lookup_errno == EISDIR) {
+            keep_alive = send_response(newsockfd, "403 Forbidden", "text/plain", "Forbidden: Is a directory", keep_alive);
+        } else if (lookup_errno == ENAMETOOLONG) {
+            keep_alive = send_response(newsockfd, "414 URI Too Long", "text/plain", "URI Too Long", keep_alive);
+        } else {
+            keep_alive = send_response(newsockfd, "404 Not Found", "text/plain", "File Not Found", keep_alive);
+        }
+    } else if (cached != NULL) {
+        keep_alive = serve_cached(newsockfd, req, cached, keep_alive);
+        file_cache_release(&cache, cached);
+    } else {
+        keep_alive = serve_file(newsockfd, req, file, keep_alive);
+    }
+    stats_stage_end(STATS_SEND, &start);
+    if (file != NULL) {
+        docroot_release(&docroot, file);
     }
+    return keep_alive;
+}
 
-    if (read(filefd, filecontent, filestat.st_size) < 0) {
-        perror("ERROR reading file");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        free(filecontent);
-        close(filefd);
-        return;
+// Limits the next read to the time left until deadline (CLOCK_MONOTONIC
+// nanoseconds). Returns -1 once the deadline has passed.
+int read_deadline(int newsockfd, uint64_t deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    if (now_ns >= deadline) {
+        return -1;
     }
-    close(filefd);
+    uint64_t left_us = (deadline - now_ns + 999) / 1000;
+    struct timeval timeout = { left_us / 1000000, left_us % 1000000 };
+    return setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Serves requests on the connection until the client closes it, it stays
+// idle for KEEPALIVE_TIMEOUT seconds or KEEPALIVE_MAX requests have been
+// answered. A request head must be complete HEADER_TIMEOUT seconds after
+// its first byte, and a write that makes no progress for WRITE_TIMEOUT
+// seconds closes the connection. Pipelined requests that arrive together
+// are answered in order.
+// accepted_at is the stats_now() time the connection was accepted.
+void handle_connection(int newsockfd, uint64_t accepted_at) {
+    stats_count(STATS_CONNECTIONS);
+    struct timeval timeout = { KEEPALIVE_TIMEOUT, 0 };
+    setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct timeval write_timeout = { WRITE_TIMEOUT, 0 };
+    setsockopt(newsockfd, SOL_SOCKET, SO_SNDTIMEO, &write_timeout, sizeof(write_timeout));
 
-    // Send the response
-    send_response(newsockfd, "200 OK", "text/html", filecontent);
-    free(filecontent);
+    char buffer[HTTP_MAX_HEAD];
+    size_t len = 0;
+    int served = 0;
+    http_request req;
+    http_request_init(&req);
+    while (1) {
+        // Read until a complete request head is buffered
+        // Only parsing is timed, not waiting for the client
+        int head_len;
+        uint64_t head_deadline = 0;  // set once the head has begun
+        uint64_t parse_ns = 0, parse_start = stats_now();
+        while ((head_len = http_parse_request(&req, buffer, len)) == HTTP_PARSE_INCOMPLETE) {
+            parse_ns += stats_now() - parse_start;
+            if (len == sizeof(buffer)) {
+                send_response(newsockfd, "431 Request Header Fields Too Large", "text/plain",
+                              "Request Header Fields Too Large", 0);
+                return;
+            }
+            // A head trickling in does not get a fresh timeout per read,
+            // only what is left of HEADER_TIMEOUT
+            if (len > 0) {
+                if (head_deadline == 0) {
+                    head_deadline = parse_start + HEADER_TIMEOUT * 1000000000ull;
+                }
+                if (read_deadline(newsockfd, head_deadline) < 0) return;
+            }
+            ssize_t n = read(newsockfd, buffer + len, sizeof(buffer) - len);
+            parse_start = stats_now();
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;  // closed by the client, timeout or error
+            len += n;
+        }
+        if (head_deadline != 0) {
+            setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+        stats_record(STATS_PARSE, parse_ns + stats_now() - parse_start);
+        stats_count(STATS_REQUESTS);
+        if (head_len == HTTP_PARSE_ERROR) {
+            send_response(newsockfd, "400 Bad Request", "text/plain", "Bad Request", 0);
+            return;
+        }
+
+        if (!handle_request(newsockfd, &req, served++, accepted_at)) return;
+
+        // Keep whatever the client pipelined after this request
+        memmove(buffer, buffer + head_len, len - head_len);
+        len -= head_len;
+        http_request_init(&req);
+    }
 }
 
 int main(int argc, char *argv[]) {
@@ -99,21 +353,29 @@ int main(int argc, char *argv[]) {
     socklen_t clilen;
     struct sockaddr_in serv_addr, cli_addr;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <root_directory>\n", argv[0]);
+    int first = admission_init(argc, argv);
+    if (first < 0 || argc - first < 2) {
+        fprintf(stderr, "Usage: %s [options] <port> <root_directory>\n", argv[0]);
+        fprintf(stderr, "%s", ADMISSION_USAGE);
         exit(1);
     }
+    argc -= first - 1;
+    argv += first - 1;  // argv[1] is the port from here on
 
     portno = atoi(argv[1]);
     ROOT = argv[2];
 
     // Ensure ROOT is a directory, not a file
     struct stat root_stat;
-    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode)) {
+    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode) || docroot_init(&docroot, ROOT) < 0) {
         fprintf(stderr, "ERROR: Root directory is not valid\n");
         exit(1);
     }
 
+    file_cache_init(&cache, docroot.dir_fd);
+    if (stats_init() < 0) perror("ERROR mapping statistics");
+    signal(SIGPIPE, SIG_IGN);  // a vanished client must not kill the server
+
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) error("ERROR opening socket");
     printf("Socket created successfully\n");
@@ -127,7 +389,7 @@ int main(int argc, char *argv[]) {
         error("ERROR on binding");
     printf("Binding successful\n");
 
-    listen(sockfd, 5);
+    listen(sockfd, admission->backlog);
     printf("Listening on port %d\n", portno);
     clilen = sizeof(cli_addr);
 
@@ -138,10 +400,16 @@ int main(int argc, char *argv[]) {
         newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
         if (newsockfd < 0) error("ERROR on accept");
 
+        if (!admission_admit(sockfd, 0)) {
+            admission_reject(newsockfd);
+            printf("Overloaded, connection shed\n");
+            continue;
+        }
         printf("Accepted connection from client\n");
 
-        handle_request(newsockfd);
+        handle_connection(newsockfd, stats_now());
         close(newsockfd);
+        admission_done();
         printf("Connection closed\n");
     }
 
@@ -7,178 +7,523 @@
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
-#define QUEUE_SIZE 10
-#define THREAD_POOL_SIZE 4
+#include "http_parser.h"
+#include "docroot.h"
+#include "file_cache.h"
+#include "response.h"
+#include "range.h"
+#include "conditional.h"
+#include "stats.h"
+#include "admission.h"
+#include "mpmc_ring.h"
+
+#define WORKER_QUEUE_SIZE 64   // accepted connections waiting on each worker
+#define MAX_THREADS_FACTOR 4   // default ceiling on workers, per initial worker
+
+#define KEEPALIVE_TIMEOUT 5    // seconds an idle connection is kept open
+#define KEEPALIVE_MAX 100      // requests served before the connection is closed
+#define HEADER_TIMEOUT 10      // seconds to finish a request head once it has begun
+#define WRITE_TIMEOUT 10       // seconds a write may wait without the client reading any of it
 
 char *ROOT;  // Diretório raiz para os arquivos
+docroot_index docroot;  // files of ROOT resolved so far
+file_cache cache;       // small files kept in memory between requests
 
-typedef struct Task {
-    int client_socket;
-    struct Task* next;
-} Task;
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
 
-typedef struct {
-    Task* front;
-    Task* rear;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
-} TaskQueue;
-
-TaskQueue* createQueue() {
-    TaskQueue* queue = (TaskQueue*)malloc(sizeof(TaskQueue));
-    queue->front = queue->rear = NULL;
-    pthread_mutex_init(&queue->mutex, NULL);
-    pthread_cond_init(&queue->cond, NULL);
-    return queue;
-}
-
-void enqueue(TaskQueue* queue, int client_socket) {
-    Task* newTask = (Task*)malloc(sizeof(Task));
-    newTask->client_socket = client_socket;
-    newTask->next = NULL;
-    pthread_mutex_lock(&queue->mutex);
-    if (queue->rear == NULL) {
-        queue->front = queue->rear = newTask;
-    } else {
-        queue->rear->next = newTask;
-        queue->rear = newTask;
+// Sends a small in-memory response; returns keep_alive, or 0 if the write failed.
+int send_response(int newsockfd, const char *status, const char *content_type, const char *body,
+                  int keep_alive) {
+    stats_status(status);
+    response r;
+    response_init(&r);
+    response_start(&r, status, content_type, strlen(body), keep_alive);
+    response_end_headers(&r);
+    response_add(&r, body, strlen(body));
+    if (response_send_all(&r, newsockfd, 0) < 0) {
+        return 0;
     }
-    pthread_cond_signal(&queue->cond);
-    pthread_mutex_unlock(&queue->mutex);
+    return keep_alive;
 }
 
-int dequeue(TaskQueue* queue) {
-    pthread_mutex_lock(&queue->mutex);
-    while (queue->front == NULL) {
-        pthread_cond_wait(&queue->cond, &queue->mutex);
+// Sends a cached file: pre-rendered header, Connection header and body in one sendmsg().
+int send_cached(int newsockfd, const cache_entry *cached, int keep_alive) {
+    stats_status("200 OK");
+    response r;
+    response_init(&r);
+    response_add(&r, cached->header, cached->header_len);
+    response_printf(&r, "Connection: %s\r\n\r\n", keep_alive ? "keep-alive" : "close");
+    response_add(&r, cached->data, cached->size);
+    return response_send_all(&r, newsockfd, 0);
+}
+
+// Tells a revalidating client its copy is still current.
+int send_not_modified(int newsockfd, const http_validators *validators, const char *content_type,
+                      int keep_alive) {
+    stats_status("304 Not Modified");
+    response r;
+    response_init(&r);
+    response_not_modified(&r, validators, content_type, keep_alive);
+    return response_send_all(&r, newsockfd, 0) < 0 ? 0 : keep_alive;
+}
+
+// Streams len bytes of the file from offset straight from the page cache
+// to the socket.
+int send_file(int newsockfd, int filefd, off_t offset, off_t len) {
+    off_t end = offset + len;
+    while (offset < end) {
+        ssize_t n = sendfile(newsockfd, filefd, &offset, end - offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) return -1;  // file shrank underneath us
     }
-    Task* temp = queue->front;
-    int client_socket = temp->client_socket;
-    queue->front = queue->front->next;
-    if (queue->front == NULL) {
-        queue->rear = NULL;
+    return 0;
+}
+
+// Answers a Range request from a cached body (data) or from filefd: one
+// range as a plain 206, several as multipart/byteranges and none that is
+// satisfiable as 416. Returns keep_alive, or 0 if the write failed.
+int send_ranges(int newsockfd, const byte_range *ranges, int nranges, const char *data, int filefd,
+                off_t size, const char *content_type, const http_validators *validators, int keep_alive) {
+    response r;
+    response_init(&r);
+    if (nranges == RANGE_UNSATISFIABLE) {
+        stats_status("416 Range Not Satisfiable");
+        response_start(&r, "416 Range Not Satisfiable", "text/plain", 0, keep_alive);
+        response_printf(&r, "Content-Range: bytes */%lld\r\n", (long long)size);
+        response_end_headers(&r);
+        return response_send_all(&r, newsockfd, 0) < 0 ? 0 : keep_alive;
     }
-    free(temp);
-    pthread_mutex_unlock(&queue->mutex);
-    return client_socket;
+
+    stats_status("206 Partial Content");
+    if (nranges == 1) {
+        response_start(&r, "206 Partial Content", content_type, ranges[0].end - ranges[0].start, keep_alive);
+        response_printf(&r, "Content-Range: bytes %lld-%lld/%lld\r\n", (long long)ranges[0].start,
+                        (long long)ranges[0].end - 1, (long long)size);
+    } else {
+        response_start(&r, "206 Partial Content", RANGE_MULTIPART_TYPE,
+                       range_multipart_length(ranges, nranges, content_type, size), keep_alive);
+    }
+    response_validators(&r, validators);
+    response_end_headers(&r);
+
+    // Something always follows the last piece, except for a single range
+    // served from memory
+    int more = data == NULL || nranges > 1;
+    for (int i = 0; i < nranges; i++) {
+        char part[256];
+        if (nranges > 1) {
+            response_add(&r, part, range_part_header(part, sizeof(part), &ranges[i], content_type, size));
+        }
+        off_t len = ranges[i].end - ranges[i].start;
+        if (data != NULL) {
+            response_add(&r, data + ranges[i].start, len);
+        }
+        if (response_send_all(&r, newsockfd, more) < 0 ||
+            (data == NULL && send_file(newsockfd, filefd, ranges[i].start, len) < 0)) {
+            perror("ERROR sending file");
+            return 0;
+        }
+        response_init(&r);
+    }
+    if (nranges > 1) {
+        response_add(&r, RANGE_TRAILER, sizeof(RANGE_TRAILER) - 1);
+        if (response_send_all(&r, newsockfd, 0) < 0) {
+            return 0;
+        }
+    }
+    return keep_alive;
 }
 
-void error(const char *msg) {
-    perror(msg);
-    exit(1);
+// Small files are served from memory, compressed when the client accepts
+// it; ranges always refer to the uncompressed file. Files too large to cache
+// only go through the cache for a precompressed sibling. Returns NULL when
+// the file is to be sent from disk.
+cache_entry *fetch_cached(const http_request *req, const docroot_entry *file) {
+    int accepted = http_get_header(req, "Range") == NULL ? accepted_encodings(req) : 0;
+    if (!file_cache_eligible(file->st.st_size, file->content_type, accepted)) {
+        return NULL;  // sent from disk without asking the cache
+    }
+    cache_entry *cached = file_cache_get_encoded(&cache, file->path, file->content_type, accepted);
+    stats_count(cached != NULL ? STATS_CACHE_HITS : STATS_CACHE_MISSES);
+    return cached;
 }
 
-void send_response(int newsockfd, const char *status, const char *content_type, const char *body) {
-    char response[4096];
-    sprintf(response, "HTTP/1.1 %s\r\nContent-Length: %ld\r\nContent-Type: %s\r\nConnection: Closed\r\n\r\n%s",
-            status, strlen(body), content_type, body);
-    write(newsockfd, response, strlen(response));
+// Serves a file from the cache; returns whether the connection stays open.
+// Revalidations are answered from the cached validators.
+int serve_cached(int newsockfd, const http_request *req, const cache_entry *cached, int keep_alive) {
+    const http_validators *validators = &cached->validators;
+    byte_range ranges[MAX_RANGES];
+    int nranges = http_range_applies(req, validators) ? http_parse_ranges(req, cached->size, ranges) : RANGE_NONE;
+    if (http_not_modified(req, validators)) {
+        return send_not_modified(newsockfd, validators, cached->content_type, keep_alive);
+    }
+    if (nranges != RANGE_NONE) {
+        return send_ranges(newsockfd, ranges, nranges, cached->data, -1, cached->size,
+                           cached->content_type, validators, keep_alive);
+    }
+    if (send_cached(newsockfd, cached, keep_alive) < 0) {
+        perror("ERROR sending file");
+        return 0;
+    }
+    return keep_alive;
 }
 
-void handle_request(int newsockfd) {
-    char buffer[2048];
-    int n = read(newsockfd, buffer, sizeof(buffer) - 1);
-    if (n < 0) error("ERROR reading from socket");
-    buffer[n] = '\0';
+// Serves a file of the document root from disk; returns whether the
+// connection stays open.
+int serve_file(int newsockfd, const http_request *req, const docroot_entry *file, int keep_alive) {
+    // The index already holds the stat data, so revalidations are answered
+    // without touching the file
+    byte_range ranges[MAX_RANGES];
+    int nranges;
+    off_t size = file->st.st_size;
+    http_validators validators;
+    http_validators_init(&validators, &file->st.st_mtim, size, NULL);
+    if (http_not_modified(req, &validators)) {
+        return send_not_modified(newsockfd, &validators, file->content_type, keep_alive);
+    }
 
-    // Parse the request line
-    char method[16], path[256], protocol[16];
-    sscanf(buffer, "%s %s %s", method, path, protocol);
+    nranges = http_range_applies(req, &validators) ? http_parse_ranges(req, size, ranges) : RANGE_NONE;
+    if (nranges != RANGE_NONE) {
+        return send_ranges(newsockfd, ranges, nranges, NULL, file->fd, size, file->content_type,
+                           &validators, keep_alive);
+    }
 
-    // Only handle GET requests
-    if (strcmp(method, "GET") != 0) {
-        send_response(newsockfd, "405 Method Not Allowed", "text/plain", "Method Not Allowed");
-        return;
+    // Send the header, then the body without copying it through userspace;
+    // MSG_MORE lets the header share a packet with the start of the body
+    stats_status("200 OK");
+    response r;
+    response_init(&r);
+    response_start(&r, "200 OK", file->content_type, size, keep_alive);
+    response_printf(&r, "Accept-Ranges: bytes\r\n");
+    response_validators(&r, &validators);
+    response_end_headers(&r);
+    if (response_send_all(&r, newsockfd, size > 0) < 0 || send_file(newsockfd, file->fd, 0, size) < 0) {
+        perror("ERROR sending file");
+        keep_alive = 0;
     }
+    return keep_alive;
+}
 
-    // Construct the file path
-    char filepath[512];
-    if (strcmp(path, "/") == 0) {
-        snprintf(filepath, sizeof(filepath), "%s/index.html", ROOT);
-    } else {
-        snprintf(filepath, sizeof(filepath), "%s%s", ROOT, path);
+// Answers one parsed request; returns whether the connection stays open.
+// accepted_at is when the connection was accepted, for the first request.
+int handle_request(int newsockfd, const http_request *req, int served, uint64_t accepted_at) {
+    int keep_alive = served < KEEPALIVE_MAX && http_wants_keep_alive(req);
+
+    // Only handle GET requests; a request body would desync the stream
+    if (!http_slice_eq(req->method, "GET")) {
+        return send_response(newsockfd, "405 Method Not Allowed", "text/plain", "Method Not Allowed", 0);
     }
 
-    // Check if the path is a directory
-    struct stat path_stat;
-    stat(filepath, &path_stat);
-    if (S_ISDIR(path_stat.st_mode)) {
-        send_response(newsockfd, "403 Forbidden", "text/plain", "Forbidden: Is a directory");
-        return;
+    int format = stats_requested(req->path);
+    if (format != 0) {
+        size_t len;
+        char *body = stats_render(format, &len);
+        if (body == NULL) {
+            return send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error", 0);
+        }
+        keep_alive = send_response(newsockfd, "200 OK", "text/plain; charset=utf-8", body, keep_alive);
+        free(body);
+        return keep_alive;
     }
 
-    // Open the file
-    int filefd = open(filepath, O_RDONLY);
-    if (filefd < 0) {
-        perror("ERROR opening file");
-        send_response(newsockfd, "404 Not Found", "text/plain", "File Not Found");
-        return;
+    // Resolve the path beneath the document root; ".." and symlinks that
+    // lead out of it are not found
+    uint64_t start = stats_now();
+    docroot_entry *file = docroot_lookup(&docroot, req->path.ptr, req->path.len);
+    int lookup_errno = errno;
+    cache_entry *cached = NULL;
+    if (file != NULL) {
+        cached = fetch_cached(req, file);
+    }
+    stats_stage_end(STATS_FILE, &start);
+    if (served == 0) {
+        stats_record(STATS_FIRST_BYTE, start - accepted_at);
     }
 
-    // Get the file size
-    struct stat filestat;
-    if (fstat(filefd, &filestat) < 0) {
-        perror("ERROR getting file size");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        close(filefd);
-        return;
+    if (file == NULL) {
+        if (lookup_errno == EISDIR) {
+            keep_alive = send_response(newsockfd, "403 Forbidden", "text/plain", "Forbidden: Is a directory", keep_alive);
+        } else if (lookup_errno == ENAMETOOLONG) {
+            keep_alive = send_response(newsockfd, "414 URI Too Long", "text/plain", "URI Too Long", keep_alive);
+        } else {
+            keep_alive = send_response(newsockfd, "404 Not Found", "text/plain", "File Not Found", keep_alive);
+        }
+    } else if (cached != NULL) {
+        keep_alive = serve_cached(newsockfd, req, cached, keep_alive);
+        file_cache_release(&cache, cached);
+    } else {
+        keep_alive = serve_file(newsockfd, req, file, keep_alive);
+    }
+    stats_stage_end(STATS_SEND, &start);
+    if (file != NULL) {
+        docroot_release(&docroot, file);
     }
+    return keep_alive;
+}
 
-    // Read the file content
-    char *filecontent = malloc(filestat.st_size);
-    if (filecontent == NULL) {
-        perror("ERROR allocating memory");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        close(filefd);
-        return;
+// Limits the next read to the time left until deadline (CLOCK_MONOTONIC
+// nanoseconds). Returns -1 once the deadline has passed.
+int read_deadline(int newsockfd, uint64_t deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t now_ns = (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    if (now_ns >= deadline) {
+        return -1;
     }
+    uint64_t left_us = (deadline - now_ns + 999) / 1000;
+    struct timeval timeout = { left_us / 1000000, left_us % 1000000 };
+    return setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
 
-    if (read(filefd, filecontent, filestat.st_size) < 0) {
-        perror("ERROR reading file");
-        send_response(newsockfd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        free(filecontent);
-        close(filefd);
-        return;
+// Serves requests on the connection until the client closes it, it stays
+// idle for KEEPALIVE_TIMEOUT seconds or KEEPALIVE_MAX requests have been
+// answered. A request head must be complete HEADER_TIMEOUT seconds after
+// its first byte, and a write that makes no progress for WRITE_TIMEOUT
+// seconds closes the connection. Pipelined requests that arrive together
+// are answered in order.
+// accepted_at is the stats_now() time the connection was accepted.
+void handle_connection(int newsockfd, uint64_t accepted_at) {
+    stats_count(STATS_CONNECTIONS);
+    struct timeval timeout = { KEEPALIVE_TIMEOUT, 0 };
+    setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct timeval write_timeout = { WRITE_TIMEOUT, 0 };
+    setsockopt(newsockfd, SOL_SOCKET, SO_SNDTIMEO, &write_timeout, sizeof(write_timeout));
+
+    char buffer[HTTP_MAX_HEAD];
+    size_t len = 0;
+    int served = 0;
+    http_request req;
+    http_request_init(&req);
+    while (1) {
+        // Read until a complete request head is buffered
+        // Only parsing is timed, not waiting for the client
+        int head_len;
+        uint64_t head_deadline = 0;  // set once the head has begun
+        uint64_t parse_ns = 0, parse_start = stats_now();
+        while ((head_len = http_parse_request(&req, buffer, len)) == HTTP_PARSE_INCOMPLETE) {
+            parse_ns += stats_now() - parse_start;
+            if (len == sizeof(buffer)) {
+                send_response(newsockfd, "431 Request Header Fields Too Large", "text/plain",
+                              "Request Header Fields Too Large", 0);
+                return;
+            }
+            // A head trickling in does not get a fresh timeout per read,
+            // only what is left of HEADER_TIMEOUT
+            if (len > 0) {
+                if (head_deadline == 0) {
+                    head_deadline = parse_start + HEADER_TIMEOUT * 1000000000ull;
+                }
+                if (read_deadline(newsockfd, head_deadline) < 0) return;
+            }
+            ssize_t n = read(newsockfd, buffer + len, sizeof(buffer) - len);
+            parse_start = stats_now();
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return;  // closed by the client, timeout or error
+            len += n;
+        }
+        if (head_deadline != 0) {
+            setsockopt(newsockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+        stats_record(STATS_PARSE, parse_ns + stats_now() - parse_start);
+        stats_count(STATS_REQUESTS);
+        if (head_len == HTTP_PARSE_ERROR) {
+            send_response(newsockfd, "400 Bad Request", "text/plain", "Bad Request", 0);
+            return;
+        }
+
+        if (!handle_request(newsockfd, &req, served++, accepted_at)) return;
+
+        // Keep whatever the client pipelined after this request
+        memmove(buffer, buffer + head_len, len - head_len);
+        len -= head_len;
+        http_request_init(&req);
     }
-    close(filefd);
+}
 
-    // Send the response
-    send_response(newsockfd, "200 OK", "text/html", filecontent);
-    free(filecontent);
+struct ThreadPool;
+
+typedef struct {
+    mpmc_ring queue;          // connections handed to this worker; idle workers steal from it
+    struct ThreadPool* pool;
+    int id;
+    pthread_t thread;
+} Worker;
+
+// The accept thread deals connections round-robin into per-worker queues.
+// A worker serves its own queue first and steals from the others when it
+// runs dry, so connections queued behind a slow client are picked up by
+// whoever is free. When every worker is busy the pool grows, up to
+// max_workers.
+typedef struct ThreadPool {
+    Worker* workers;          // max_workers slots, the first nworkers running
+    int max_workers;
+    _Atomic int nworkers;
+    _Atomic int busy;         // workers currently serving a connection
+    _Atomic int waiting;      // connections queued and not yet taken
+    _Atomic uint32_t work;    // futex bumped when connections are queued
+    _Atomic uint64_t idle_waiting;
+    _Atomic uint32_t space;   // futex bumped when a queue slot frees up
+    _Atomic uint64_t accept_waiting;
+    unsigned next;            // round-robin cursor, used by the accept thread only
+} ThreadPool;
+
+// Takes a connection from the worker's own queue, or steals one.
+int pool_try_take(ThreadPool* pool, int self, ring_conn* client) {
+    int n = atomic_load_explicit(&pool->nworkers, memory_order_acquire);
+    for (int i = 0; i < n; i++) {
+        if (ring_try_pop(&pool->workers[(self + i) % n].queue, client)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+ring_conn pool_take(ThreadPool* pool, int self) {
+    ring_conn client;
+    uint64_t announced = 0;
+    uint32_t seen = 0;
+    while (!pool_try_take(pool, self, &client)) {
+        // Announce ourselves before the last check so a submitter either
+        // sees us waiting or we see its connection
+        if (!announced) {
+            seen = atomic_load(&pool->work);
+            announced = ring_announce(&pool->idle_waiting);
+            continue;
+        }
+        ring_futex_wait(&pool->work, seen);
+        announced = 0;
+    }
+    if (announced) {
+        ring_withdraw(&pool->idle_waiting, announced);
+    }
+    atomic_fetch_sub(&pool->waiting, 1);
+    ring_futex_wake(&pool->space, &pool->accept_waiting);
+    return client;
 }
 
 void* thread_function(void* arg) {
-    TaskQueue* queue = (TaskQueue*)arg;
+    Worker* worker = (Worker*)arg;
+    ThreadPool* pool = worker->pool;
     while (1) {
-        int client_socket = dequeue(queue);
-        handle_request(client_socket);
-        close(client_socket);
+        ring_conn client = pool_take(pool, worker->id);
+        atomic_fetch_add(&pool->busy, 1);
+        handle_connection(client.fd, client.accepted_at);
+        close(client.fd);
+        admission_done();
+        atomic_fetch_sub(&pool->busy, 1);
     }
     return NULL;
 }
 
+// Starts the next worker. Only the accept thread calls this.
+int pool_start_worker(ThreadPool* pool) {
+    int id = atomic_load(&pool->nworkers);
+    Worker* worker = &pool->workers[id];
+    if (ring_init(&worker->queue, WORKER_QUEUE_SIZE) < 0) {
+        return -1;
+    }
+    worker->pool = pool;
+    worker->id = id;
+    // Publish the queue before stealers can see it
+    atomic_store_explicit(&pool->nworkers, id + 1, memory_order_release);
+    if (pthread_create(&worker->thread, NULL, thread_function, worker) != 0) {
+        // The slot stays visible so its queue can still be drained by stealing
+        return -1;
+    }
+    return 0;
+}
+
+void pool_init(ThreadPool* pool, int nworkers, int max_workers) {
+    memset(pool, 0, sizeof(*pool));
+    pool->max_workers = max_workers;
+    pool->workers = calloc(max_workers, sizeof(Worker));
+    if (pool->workers == NULL) error("ERROR allocating thread pool");
+    for (int i = 0; i < nworkers; i++) {
+        if (pool_start_worker(pool) < 0) error("ERROR starting worker");
+    }
+}
+
+// Queues a connection, blocking while every worker queue is full so excess
+// connections wait in the kernel's accept backlog instead of piling up here.
+void pool_submit(ThreadPool* pool, ring_conn client) {
+    uint64_t announced = 0;
+    uint32_t seen = 0;
+    while (1) {
+        int n = atomic_load(&pool->nworkers);
+        for (int i = 0; i < n; i++) {
+            if (ring_try_push(&pool->workers[pool->next++ % n].queue, client)) {
+                if (announced) {
+                    ring_withdraw(&pool->accept_waiting, announced);
+                }
+                atomic_fetch_add(&pool->waiting, 1);
+                ring_futex_wake(&pool->work, &pool->idle_waiting);
+                // Everyone is stuck on a connection: add a worker to steal this one
+                if (atomic_load(&pool->busy) >= n && n < pool->max_workers) {
+                    if (pool_start_worker(pool) == 0) {
+                        printf("All %d workers busy, pool grown to %d\n", n, n + 1);
+                    }
+                }
+                return;
+            }
+        }
+        if (!announced) {
+            seen = atomic_load(&pool->space);
+            announced = ring_announce(&pool->accept_waiting);
+            continue;
+        }
+        ring_futex_wait(&pool->space, seen);
+        announced = 0;
+    }
+}
+
 int main(int argc, char *argv[]) {
     int sockfd, newsockfd, portno;
     socklen_t clilen;
     struct sockaddr_in serv_addr, cli_addr;
 
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <root_directory>\n", argv[0]);
+    int first = admission_init(argc, argv);
+    if (first < 0 || argc - first < 2) {
+        fprintf(stderr, "Usage: %s [options] <port> <root_directory> [threads] [max_threads]\n", argv[0]);
+        fprintf(stderr, "  threads:     initial workers (default: online CPUs)\n");
+        fprintf(stderr, "  max_threads: ceiling when every worker is busy (default: %d x threads)\n",
+                MAX_THREADS_FACTOR);
+        fprintf(stderr, "%s", ADMISSION_USAGE);
         exit(1);
     }
+    argc -= first - 1;
+    argv += first - 1;  // argv[1] is the port from here on
 
     portno = atoi(argv[1]);
     ROOT = argv[2];
+    int nthreads = argc > 3 ? atoi(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0) nthreads = 1;
+    int max_threads = argc > 4 ? atoi(argv[4]) : nthreads * MAX_THREADS_FACTOR;
+    if (max_threads < nthreads) max_threads = nthreads;
 
     // Ensure ROOT is a directory, not a file
     struct stat root_stat;
-    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode)) {
+    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode) || docroot_init(&docroot, ROOT) < 0) {
         fprintf(stderr, "ERROR: Root directory is not valid\n");
         exit(1);
     }
 
+    file_cache_init(&cache, docroot.dir_fd);
+    if (stats_init() < 0) perror("ERROR mapping statistics");
+    signal(SIGPIPE, SIG_IGN);  // a vanished client must not kill the server
+
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) error("ERROR opening socket");
     printf("Socket created successfully\n");
@@ -192,26 +537,30 @@ int main(int argc, char *argv[]) {
         error("ERROR on binding");
     printf("Binding successful\n");
 
-    listen(sockfd, QUEUE_SIZE);
+    listen(sockfd, admission->backlog);
     printf("Listening on port %d\n", portno);
     clilen = sizeof(cli_addr);
 
-    printf("Server started on port %d with root directory %s\n", portno, ROOT);
+    printf("Server started on port %d with root directory %s (%d-%d workers)\n",
+           portno, ROOT, nthreads, max_threads);
 
-    TaskQueue* queue = createQueue();
-    pthread_t thread_pool[THREAD_POOL_SIZE];
-    for (int i = 0; i < THREAD_POOL_SIZE; i++) {
-        pthread_create(&thread_pool[i], NULL, thread_function, (void*)queue);
-    }
+    ThreadPool pool;
+    pool_init(&pool, nthreads, max_threads);
 
     while (1) {
         printf("Waiting for a connection...\n");
         newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
         if (newsockfd < 0) error("ERROR on accept");
 
+        ring_conn client = { newsockfd, stats_now() };
+        if (!admission_admit(sockfd, atomic_load(&pool.waiting))) {
+            admission_reject(newsockfd);
+            printf("Overloaded, connection shed\n");
+            continue;
+        }
         printf("Accepted connection from client\n");
 
-        enqueue(queue, newsockfd);
+        pool_submit(&pool, client);
     }
 
     close(sockfd);
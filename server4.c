@@ -1,3 +1,4 @@
+#define _GNU_SOURCE  // pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,196 +6,927 @@
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 
-#define BUFFER_SIZE 1024
+#include "http_parser.h"
+#include "docroot.h"
+#include "file_cache.h"
+#include "buffer_pool.h"
+#include "response.h"
+#include "range.h"
+#include "conditional.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "admission.h"
+
+#define MAX_EVENTS 1024
+#define KEEPALIVE_TIMEOUT 5    // seconds an idle connection is kept open
+#define HEADER_TIMEOUT 10      // seconds to finish a request head once it has begun
+#define WRITE_TIMEOUT 10       // seconds queued output may wait without the client reading any of it
+#define TIMER_TICK_MS 100      // resolution of the connection timeouts
+#define KEEPALIVE_MAX 100      // requests served before the connection is closed
+#define RESPONSE_ARENA_SIZE 8192  // per-connection block for queued responses; more spills to malloc
+#define POOL_SLAB_OBJECTS 64      // connections or blocks carved per slab
+#define OUTPUT_HIGH_WATERMARK (64 * 1024)  // queued bytes at which reading is paused
+#define OUTPUT_LOW_WATERMARK (16 * 1024)   // queued bytes at which reading resumes
+#define OUTPUT_QUEUE_MAX 8        // queued responses at which reading is paused
 
 char *ROOT;  // Diretório raiz para os arquivos
 
-void send_response(int client_fd, const char *status, const char *content_type, const char *body) {
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response),
-             "HTTP/1.1 %s\r\n"
-             "Content-Type: %s\r\n"
-             "Content-Length: %ld\r\n"
-             "\r\n"
-             "%s",
-             status, content_type, strlen(body), body);
-    send(client_fd, response, strlen(response), 0);
-}
-
-void handle_client(int client_fd) {
-    char buffer[BUFFER_SIZE];
-    int bytes_read = recv(client_fd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_read < 0) {
-        perror("ERROR reading from socket");
-        close(client_fd);
+// Estados de uma conexão no loop de eventos
+typedef enum {
+    CONN_READING,   // taking requests and queueing their responses
+    CONN_WRITING,   // reading paused until the output queue drains
+    CONN_CLOSED
+} ConnState;
+
+// What a connection's timer is running for
+typedef enum {
+    TIMEOUT_NONE,
+    TIMEOUT_HEADER,  // the rest of a request head, or the first one after accept
+    TIMEOUT_IDLE,    // the next request on a kept-alive connection
+    TIMEOUT_WRITE    // the client reading queued output
+} Timeout;
+
+// A response waiting in a connection's output queue
+typedef struct OutItem {
+    struct OutItem *next;
+    response resp;        // header and in-memory body
+    cache_entry *cached;  // cache entry resp points into, or NULL
+    int file_fd;          // body streamed with sendfile() after resp, or -1
+    docroot_entry *file;  // index entry file_fd belongs to; range parts share one
+    off_t file_off;       // next byte of file_fd to send
+    off_t file_end;
+    uint64_t queued_at;   // stats_now() when the response was built; set on its last item only
+} OutItem;
+
+typedef struct Connection {
+    int fd;
+    ConnState state;
+    int keep_alive;    // cleared once the response before the close is queued
+    int requests;      // requests served on this connection so far
+    struct Reactor *reactor;         // event loop that owns the connection
+    uint64_t accepted_at;  // stats_now() at accept, until the first response starts going out
+    uint64_t parse_ns;     // time spent parsing the request at the front of in
+    wheel_timer timer;     // in the reactor's wheel while the connection is open
+    Timeout timeout;       // what the timer runs for; TIMEOUT_NONE makes arm_timer() restart it
+    int wrote;             // queued output made progress since the timer was armed
+    char in[HTTP_MAX_HEAD];
+    size_t in_len;
+    http_request req;  // parser state for the request at the front of in
+    arena arena;       // response memory, holding a pool block only while output is queued
+    // Responses not yet sent, oldest first, allocated from arena. Pipelined
+    // requests are answered into the queue until it reaches a watermark.
+    OutItem *out_head, *out_tail;
+    int out_count;
+    int want_write;    // EPOLLOUT is registered: the queue is blocked on the socket
+} Connection;
+
+// One event loop per thread. Each reactor owns its listening socket (bound
+// with SO_REUSEPORT so the kernel spreads connections between them), epoll
+// instance, timing wheel, file cache and allocation pools: reactors share
+// nothing while serving requests.
+typedef struct Reactor {
+    int listen_fd;
+    int epoll_fd;
+    int cpu;           // CPU the thread is pinned to, or -1
+    timer_wheel timers;     // header, idle and write timeouts of its connections
+    docroot_index docroot;  // files of ROOT resolved so far
+    file_cache cache;       // small files kept in memory between requests
+    slab_pool connections;  // Connection objects
+    slab_pool buffers;      // RESPONSE_ARENA_SIZE blocks for the per-request arenas
+    pthread_t thread;
+} Reactor;
+
+// Current tick of the timing wheels
+uint64_t now_ticks(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / TIMER_TICK_MS;
+}
+
+// Arms the timeout for what the connection now waits on: the client reading
+// queued output, the rest of a request head or the next request. The header
+// deadline runs from the first byte and is not pushed back by later ones,
+// so a client trickling its header cannot hold the connection; the write
+// deadline is pushed back whenever output makes progress.
+void arm_timer(Connection *conn) {
+    Timeout timeout;
+    int seconds;
+    if (conn->out_head != NULL) {
+        timeout = TIMEOUT_WRITE;
+        seconds = WRITE_TIMEOUT;
+    } else if (conn->in_len > 0 || conn->requests == 0) {
+        timeout = TIMEOUT_HEADER;
+        seconds = HEADER_TIMEOUT;
+    } else {
+        timeout = TIMEOUT_IDLE;
+        seconds = KEEPALIVE_TIMEOUT;
+    }
+    if (timeout == conn->timeout && !(timeout == TIMEOUT_WRITE && conn->wrote)) {
         return;
     }
-    buffer[bytes_read] = '\0';
+    conn->timeout = timeout;
+    conn->wrote = 0;
+    wheel_schedule(&conn->reactor->timers, &conn->timer, now_ticks() + seconds * 1000 / TIMER_TICK_MS);
+}
 
-    // Parse HTTP request
-    char method[16], path[256];
-    sscanf(buffer, "%s %s", method, path);
+// Allocates from the connection's arena, taking a block from the reactor's
+// pool on the first allocation after the output queue was empty.
+void *request_alloc(Connection *conn, size_t size) {
+    if (conn->arena.base == NULL) {
+        void *block = slab_alloc(&conn->reactor->buffers);
+        arena_init(&conn->arena, block, block != NULL ? RESPONSE_ARENA_SIZE : 0);
+    }
+    return arena_alloc(&conn->arena, size);
+}
 
-    // Construct file path
-    char filepath[512];
-    if (strcmp(path, "/") == 0) {
-        snprintf(filepath, sizeof(filepath), "%s/index.html", ROOT);
+// Drops everything allocated for queued responses and returns the block.
+void request_release(Connection *conn) {
+    arena_reset(&conn->arena);
+    if (conn->arena.base != NULL) {
+        slab_free(&conn->reactor->buffers, conn->arena.base);
+        conn->arena.base = NULL;
+    }
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Appends an empty response to the output queue; NULL when out of memory.
+OutItem *queue_item(Connection *conn) {
+    OutItem *item = request_alloc(conn, sizeof(OutItem));
+    if (item == NULL) {
+        perror("ERROR allocating memory");
+        conn->state = CONN_CLOSED;
+        return NULL;
+    }
+    item->next = NULL;
+    response_init(&item->resp);
+    item->cached = NULL;
+    item->file_fd = -1;
+    item->file = NULL;
+    item->file_off = item->file_end = 0;
+    item->queued_at = 0;
+    if (conn->out_tail) conn->out_tail->next = item; else conn->out_head = item;
+    conn->out_tail = item;
+    conn->out_count++;
+    return item;
+}
+
+// Closes what a response holds on to; its memory goes with the arena.
+void release_item(Connection *conn, OutItem *item) {
+    if (item->file != NULL) {
+        docroot_release(&conn->reactor->docroot, item->file);
+    }
+    if (item->cached != NULL) {
+        file_cache_release(&conn->reactor->cache, item->cached);
+    }
+}
+
+// Bytes of queued responses not yet sent
+size_t output_queued(const Connection *conn) {
+    size_t n = 0;
+    for (const OutItem *item = conn->out_head; item != NULL; item = item->next) {
+        n += response_remaining(&item->resp) + (item->file_end - item->file_off);
+    }
+    return n;
+}
+
+// Queues a response and starts its header; the caller adds any further
+// headers and ends it.
+OutItem *queue_header(Connection *conn, const char *status, const char *content_type,
+                      off_t content_length) {
+    OutItem *item = queue_item(conn);
+    if (item != NULL) {
+        stats_status(status);
+        response_start(&item->resp, status, content_type, content_length, conn->keep_alive);
+    }
+    return item;
+}
+
+// Queues a response with the header and an in-memory body, which is
+// referenced rather than copied and must outlive the response (callers
+// pass string literals).
+OutItem *queue_response(Connection *conn, const char *status, const char *content_type,
+                        const char *body, size_t body_len) {
+    OutItem *item = queue_header(conn, status, content_type, body_len);
+    if (item == NULL) {
+        return NULL;
+    }
+    response_end_headers(&item->resp);
+    response_add(&item->resp, body, body_len);
+    return item;
+}
+
+// Queues the items of a Range answer; see queue_ranges(). Returns the last
+// item, or NULL when out of memory.
+OutItem *queue_range_parts(Connection *conn, const byte_range *ranges, int nranges,
+                           const char *data, const docroot_entry *file, off_t size,
+                           const char *content_type, const http_validators *validators) {
+    OutItem *item;
+    if (nranges == RANGE_UNSATISFIABLE) {
+        item = queue_header(conn, "416 Range Not Satisfiable", "text/plain", 0);
+        if (item != NULL) {
+            response_printf(&item->resp, "Content-Range: bytes */%lld\r\n", (long long)size);
+        }
+    } else if (nranges == 1) {
+        item = queue_header(conn, "206 Partial Content", content_type, ranges[0].end - ranges[0].start);
+        if (item != NULL) {
+            response_printf(&item->resp, "Content-Range: bytes %lld-%lld/%lld\r\n",
+                            (long long)ranges[0].start, (long long)ranges[0].end - 1, (long long)size);
+        }
     } else {
-        snprintf(filepath, sizeof(filepath), "%s%s", ROOT, path);
+        item = queue_header(conn, "206 Partial Content", RANGE_MULTIPART_TYPE,
+                            range_multipart_length(ranges, nranges, content_type, size));
+    }
+    if (item == NULL) {
+        return NULL;
+    }
+    if (nranges != RANGE_UNSATISFIABLE) {
+        response_validators(&item->resp, validators);
+    }
+    response_end_headers(&item->resp);
+
+    for (int i = 0; i < nranges; i++) {
+        if (i > 0 && (item = queue_item(conn)) == NULL) {
+            return NULL;
+        }
+        if (nranges > 1) {
+            char part[256];
+            range_part_header(part, sizeof(part), &ranges[i], content_type, size);
+            response_printf(&item->resp, "%s", part);
+        }
+        if (data != NULL) {
+            response_add(&item->resp, data + ranges[i].start, ranges[i].end - ranges[i].start);
+        } else {
+            item->file_fd = file->fd;
+            item->file_off = ranges[i].start;
+            item->file_end = ranges[i].end;
+        }
     }
+    if (nranges > 1 && (item = queue_item(conn)) != NULL) {
+        response_add(&item->resp, RANGE_TRAILER, sizeof(RANGE_TRAILER) - 1);
+    }
+    return item;
+}
 
-    printf("Requested file: %s\n", filepath);  // Debugging message
+/* Queues the answer to a Range request over a body of size bytes: one range
+ * as a plain 206, several as multipart/byteranges and none that is
+ * satisfiable as 416. Each part is an item of its own so it can carry its
+ * offsets into the file; with data (a cached body) the parts are referenced
+ * in memory instead and file is NULL. The last item takes over the
+ * reference to file. Returns that item, or NULL when out of memory. */
+OutItem *queue_ranges(Connection *conn, const byte_range *ranges, int nranges, const char *data,
+                      docroot_entry *file, off_t size, const char *content_type,
+                      const http_validators *validators) {
+    OutItem *item = queue_range_parts(conn, ranges, nranges, data, file, size, content_type, validators);
+    if (file != NULL) {
+        if (item == NULL) {
+            docroot_release(&conn->reactor->docroot, file);
+        } else {
+            item->file = file;
+        }
+    }
+    return item;
+}
+
+void send_response(Connection *conn, const char *status, const char *content_type,
+                   const char *body, size_t body_len) {
+    queue_response(conn, status, content_type, body, body_len);
+}
+
+void send_error(Connection *conn, const char *status, const char *body) {
+    send_response(conn, status, "text/plain", body, strlen(body));
+}
 
-    // Check if the path is a directory
-    struct stat path_stat;
-    if (stat(filepath, &path_stat) < 0) {
-        perror("ERROR stat file");
-        send_response(client_fd, "404 Not Found", "text/plain", "File Not Found");
-        close(client_fd);
+// Queues the statistics page in the format stats_requested() returned. The
+// body is copied into the arena so it goes away with the response.
+void send_stats(Connection *conn, int format) {
+    size_t len;
+    char *body = stats_render(format, &len);
+    char *copy = body != NULL ? request_alloc(conn, len) : NULL;
+    if (copy == NULL) {
+        free(body);
+        conn->keep_alive = 0;
+        send_error(conn, "500 Internal Server Error", "Internal Server Error");
+        return;
+    }
+    memcpy(copy, body, len);
+    free(body);
+    send_response(conn, "200 OK", "text/plain; charset=utf-8", copy, len);
+}
+
+// Tells a revalidating client its copy is still current.
+void send_not_modified(Connection *conn, const http_validators *validators, const char *content_type) {
+    OutItem *item = queue_item(conn);
+    if (item != NULL) {
+        stats_status("304 Not Modified");
+        response_not_modified(&item->resp, validators, content_type, conn->keep_alive);
+    }
+}
+
+// Queues the response for a file of the document root, taking over the
+// reference to file.
+void queue_file(Connection *conn, docroot_entry *file) {
+    const http_request *req = &conn->req;
+    Reactor *r = conn->reactor;
+
+    // Small files are served from memory: only the Connection header is
+    // formatted, the rest of the header and the body come from the cache,
+    // compressed when the client accepts it. Ranges always refer to the
+    // uncompressed file. Revalidations are answered from the cached
+    // validators. Files too large to cache only go through the cache for a
+    // precompressed sibling, and only when their type is compressible
+    byte_range ranges[MAX_RANGES];
+    int nranges;
+    int accepted = http_get_header(req, "Range") == NULL ? accepted_encodings(req) : 0;
+    cache_entry *cached = NULL;
+    if (file_cache_eligible(file->st.st_size, file->content_type, accepted)) {
+        cached = file_cache_get_encoded(&r->cache, file->path, file->content_type, accepted);
+        stats_count(cached != NULL ? STATS_CACHE_HITS : STATS_CACHE_MISSES);
+    }
+    if (cached != NULL) {
+        docroot_release(&r->docroot, file);
+        const http_validators *validators = &cached->validators;
+        if (http_not_modified(req, validators)) {
+            send_not_modified(conn, validators, cached->content_type);
+            file_cache_release(&r->cache, cached);
+            return;
+        }
+        nranges = http_range_applies(req, validators) ? http_parse_ranges(req, cached->size, ranges) : RANGE_NONE;
+        if (nranges != RANGE_NONE) {
+            OutItem *item = queue_ranges(conn, ranges, nranges, cached->data, NULL, cached->size,
+                                         cached->content_type, validators);
+            if (item == NULL) {
+                file_cache_release(&r->cache, cached);
+            } else {
+                item->cached = cached;  // released once the last part is out
+            }
+            return;
+        }
+        OutItem *item = queue_item(conn);
+        if (item == NULL) {
+            file_cache_release(&r->cache, cached);
+            return;
+        }
+        item->cached = cached;
+        stats_status("200 OK");
+        response_add(&item->resp, cached->header, cached->header_len);
+        response_printf(&item->resp, "Connection: %s\r\n\r\n", conn->keep_alive ? "keep-alive" : "close");
+        response_add(&item->resp, cached->data, cached->size);
         return;
     }
 
-    if (S_ISDIR(path_stat.st_mode)) {
-        send_response(client_fd, "403 Forbidden", "text/plain", "Forbidden: Is a directory");
-        close(client_fd);
+    printf("Requested file: %s\n", file->path);  // Debugging message
+
+    // The index already holds the stat data, so revalidations are answered
+    // without touching the file
+    off_t size = file->st.st_size;
+    http_validators validators;
+    http_validators_init(&validators, &file->st.st_mtim, size, NULL);
+    if (http_not_modified(req, &validators)) {
+        send_not_modified(conn, &validators, file->content_type);
+        docroot_release(&r->docroot, file);
         return;
     }
 
-    // Open the file
-    int filefd = open(filepath, O_RDONLY);
-    if (filefd < 0) {
-        perror("ERROR opening file");
-        send_response(client_fd, "404 Not Found", "text/plain", "File Not Found");
-        close(client_fd);
+    nranges = http_range_applies(req, &validators) ? http_parse_ranges(req, size, ranges) : RANGE_NONE;
+    if (nranges != RANGE_NONE) {
+        queue_ranges(conn, ranges, nranges, NULL, file, size, file->content_type, &validators);
         return;
     }
 
-    // Get the file size
-    struct stat filestat;
-    if (fstat(filefd, &filestat) < 0) {
-        perror("ERROR getting file size");
-        send_response(client_fd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        close(filefd);
-        close(client_fd);
+    // Only the header is buffered; the body goes out with sendfile()
+    OutItem *item = queue_header(conn, "200 OK", file->content_type, size);
+    if (item == NULL) {
+        docroot_release(&r->docroot, file);
         return;
     }
+    response_printf(&item->resp, "Accept-Ranges: bytes\r\n");
+    response_validators(&item->resp, &validators);
+    response_end_headers(&item->resp);
+    item->file = file;
+    item->file_fd = file->fd;
+    item->file_end = size;
+}
 
-    // Read the file content
-    char *file_content = malloc(filestat.st_size);
-    if (read(filefd, file_content, filestat.st_size) < 0) {
-        perror("ERROR reading file");
-        send_response(client_fd, "500 Internal Server Error", "text/plain", "Internal Server Error");
-        free(file_content);
-        close(filefd);
-        close(client_fd);
+// Builds the response for the request parsed into conn->req.
+void build_response(Connection *conn) {
+    const http_request *req = &conn->req;
+    conn->keep_alive = conn->requests < KEEPALIVE_MAX && http_wants_keep_alive(req);
+
+    // Only handle GET requests; a request body would desync the stream
+    if (!http_slice_eq(req->method, "GET")) {
+        conn->keep_alive = 0;
+        send_error(conn, "405 Method Not Allowed", "Method Not Allowed");
         return;
     }
 
-    // Send the response
-    send_response(client_fd, "200 OK", "text/html", file_content);
+    int format = stats_requested(req->path);
+    if (format != 0) {
+        send_stats(conn, format);
+        return;
+    }
 
-    // Clean up
-    free(file_content);
-    close(filefd);
-    close(client_fd);
+    // Resolve the path beneath the document root; ".." and symlinks that
+    // lead out of it are not found
+    uint64_t start = stats_now();
+    docroot_entry *file = docroot_lookup(&conn->reactor->docroot, req->path.ptr, req->path.len);
+    if (file == NULL) {
+        if (errno == EISDIR) {
+            send_error(conn, "403 Forbidden", "Forbidden: Is a directory");
+        } else if (errno == ENAMETOOLONG) {
+            send_error(conn, "414 URI Too Long", "URI Too Long");
+        } else {
+            send_error(conn, "404 Not Found", "File Not Found");
+        }
+    } else {
+        queue_file(conn, file);
+    }
+    stats_record(STATS_FILE, stats_now() - start);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <root_directory>\n", argv[0]);
-        exit(1);
+void close_connection(Connection *conn) {
+    Reactor *r = conn->reactor;
+    wheel_cancel(&r->timers, &conn->timer);
+    close(conn->fd);  // closing the fd also removes it from the epoll set
+    for (OutItem *item = conn->out_head; item != NULL; item = item->next) {
+        release_item(conn, item);
     }
+    request_release(conn);
+    slab_free(&r->connections, conn);
+    admission_done();
+}
 
-    int port = atoi(argv[1]);
-    ROOT = argv[2];
+// Reads until EAGAIN or until the buffer holds a complete request.
+// Returns 1 when new data arrived, or when the client finished sending and
+// queued responses still have to go out, and 0 otherwise.
+int fill_input(Connection *conn) {
+    while (1) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+                         sizeof(conn->in) - conn->in_len, 0);
+        if (n > 0) {
+            conn->in_len += n;
+            return 1;
+        } else if (n == 0) {
+            // Answer what was already asked for, then close
+            conn->keep_alive = 0;
+            conn->state = conn->out_head != NULL ? CONN_WRITING : CONN_CLOSED;
+            return conn->state == CONN_WRITING;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("ERROR reading from socket");
+                conn->state = CONN_CLOSED;
+            }
+            return 0;
+        }
+    }
+}
 
-    // Ensure ROOT is a directory, not a file
-    struct stat root_stat;
-    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode)) {
-        fprintf(stderr, "ERROR: Root directory is not valid\n");
-        exit(1);
+// Takes the next complete request off the front of conn->in and queues its
+// response. Pipelined requests that follow it stay buffered for the next
+// round. Returns 0 when no complete request is buffered yet.
+int next_request(Connection *conn) {
+    uint64_t start = stats_now();
+    int head_len = http_parse_request(&conn->req, conn->in, conn->in_len);
+    conn->parse_ns += stats_now() - start;
+    if (head_len == HTTP_PARSE_INCOMPLETE && conn->in_len < sizeof(conn->in)) {
+        return 0;
+    }
+    stats_record(STATS_PARSE, conn->parse_ns);
+    stats_count(STATS_REQUESTS);
+    conn->parse_ns = 0;
+
+    OutItem *last = conn->out_tail;
+    if (head_len == HTTP_PARSE_INCOMPLETE) {
+        conn->keep_alive = 0;
+        send_error(conn, "431 Request Header Fields Too Large", "Request Header Fields Too Large");
+    } else if (head_len == HTTP_PARSE_ERROR) {
+        conn->keep_alive = 0;
+        send_error(conn, "400 Bad Request", "Bad Request");
+    } else {
+        build_response(conn);
+        memmove(conn->in, conn->in + head_len, conn->in_len - head_len);
+        conn->in_len -= head_len;
+        conn->requests++;
+        http_request_init(&conn->req);
     }
+    conn->timeout = TIMEOUT_NONE;  // the next request gets a fresh deadline
+    if (conn->out_tail != last) {
+        conn->out_tail->queued_at = stats_now();
+    }
+
+    // Stop taking requests after the last response, or while the queue is
+    // above the high watermark so a client that does not read cannot make
+    // us buffer without bound
+    if (conn->state == CONN_READING &&
+        (!conn->keep_alive || conn->out_count >= OUTPUT_QUEUE_MAX ||
+         output_queued(conn) >= OUTPUT_HIGH_WATERMARK)) {
+        conn->state = CONN_WRITING;
+    }
+    return 1;
+}
 
-    int server_fd, client_fd;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    fd_set read_fds, master_fds;
-    int fd_max;
+// Sends queued responses in order as far as the socket accepts. Returns 1
+// once the queue is empty and 0 when it has to wait for EPOLLOUT.
+int flush_output(Connection *conn) {
+    while (conn->out_head != NULL) {
+        OutItem *item = conn->out_head;
+
+        // Header and in-memory body go out together. MSG_MORE tells the
+        // kernel a sendfile() body or another response follows, so small
+        // pieces are coalesced into full packets
+        int more = (item->file_fd >= 0 && item->file_off < item->file_end) || item->next != NULL;
+        size_t unsent = response_remaining(&item->resp);
+        int sent = response_send(&item->resp, conn->fd, more);
+        if (response_remaining(&item->resp) < unsent) {
+            conn->wrote = 1;
+        }
+        if (sent <= 0) {
+            if (sent < 0) {
+                perror("ERROR writing to socket");
+                conn->state = CONN_CLOSED;
+            }
+            return 0;
+        }
+        if (conn->accepted_at != 0) {
+            stats_record(STATS_FIRST_BYTE, stats_now() - conn->accepted_at);
+            conn->accepted_at = 0;
+        }
+
+        while (item->file_fd >= 0 && item->file_off < item->file_end) {
+            ssize_t n = sendfile(conn->fd, item->file_fd, &item->file_off,
+                                 item->file_end - item->file_off);
+            if (n > 0) {
+                conn->wrote = 1;
+                continue;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return 0;
+            } else {
+                // Error, or the file shrank underneath us: the length we
+                // announced can no longer be honoured
+                if (n < 0) {
+                    perror("ERROR sending file");
+                }
+                conn->state = CONN_CLOSED;
+                return 0;
+            }
+        }
+
+        conn->out_head = item->next;
+        if (conn->out_head == NULL) {
+            conn->out_tail = NULL;
+        }
+        conn->out_count--;
+        if (item->queued_at != 0) {
+            stats_record(STATS_SEND, stats_now() - item->queued_at);
+        }
+        release_item(conn, item);
+    }
+
+    // Everything is sent: the responses' memory goes back in one step
+    request_release(conn);
+    return 1;
+}
+
+// Registers for EPOLLOUT only while responses are stuck behind a full
+// socket, so idle and reading connections do not wake the loop.
+void update_interest(Connection *conn) {
+    int want_write = conn->out_head != NULL;
+    if (want_write == conn->want_write) {
+        return;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->reactor->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        perror("ERROR updating epoll interest");
+        conn->state = CONN_CLOSED;
+        return;
+    }
+    conn->want_write = want_write;
+}
+
+// Advances the connection's state machine as far as the socket allows.
+// Sockets are edge-triggered, so it only returns once the socket would
+// block or the connection is done.
+void handle_client(Connection *conn) {
+    while (conn->state != CONN_CLOSED) {
+        if (conn->state == CONN_READING) {
+            if (next_request(conn)) {
+                continue;
+            }
+            // Send what the buffered requests produced before reading more
+            flush_output(conn);
+            if (conn->state == CONN_CLOSED || !fill_input(conn)) {
+                break;
+            }
+        } else {
+            int drained = flush_output(conn);
+            if (conn->state == CONN_CLOSED) {
+                break;
+            }
+            if (!conn->keep_alive) {
+                if (!drained) {
+                    break;
+                }
+                conn->state = CONN_CLOSED;
+            } else if (!drained && output_queued(conn) > OUTPUT_LOW_WATERMARK) {
+                break;
+            } else {
+                conn->state = CONN_READING;
+            }
+        }
+    }
+
+    if (conn->state != CONN_CLOSED) {
+        update_interest(conn);
+    }
+    if (conn->state == CONN_CLOSED) {
+        close_connection(conn);
+    } else {
+        arm_timer(conn);
+    }
+}
+
+// Closes the connections whose timeout has passed.
+void expire_connections(Reactor *r) {
+    uint64_t now = now_ticks();
+    wheel_timer *t;
+    while ((t = wheel_expire(&r->timers, now)) != NULL) {
+        close_connection((Connection *)((char *)t - offsetof(Connection, timer)));
+    }
+}
+
+void accept_connections(Reactor *r) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len;
+    char client_ip[INET_ADDRSTRLEN];
+
+    while (1) {
+        client_len = sizeof(client_addr);
+        int client_fd = accept(r->listen_fd, (struct sockaddr *)&client_addr, &client_len);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("ERROR accepting connection");
+            }
+            return;
+        }
+
+        if (!admission_admit(r->listen_fd, 0)) {
+            admission_reject(client_fd);
+            continue;
+        }
+        if (set_nonblocking(client_fd) < 0) {
+            perror("ERROR setting non-blocking mode");
+            close(client_fd);
+            admission_done();
+            continue;
+        }
+
+        Connection *conn = slab_alloc(&r->connections);
+        if (conn == NULL) {
+            perror("ERROR allocating connection");
+            close(client_fd);
+            admission_done();
+            continue;
+        }
+        memset(conn, 0, sizeof(Connection));
+        conn->fd = client_fd;
+        conn->state = CONN_READING;
+        conn->reactor = r;
+        conn->accepted_at = stats_now();
+        http_request_init(&conn->req);
+        stats_count(STATS_CONNECTIONS);
+        wheel_timer_init(&conn->timer);
+        arm_timer(conn);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;  // EPOLLOUT is added while output is blocked
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("ERROR adding client to epoll");
+            close_connection(conn);
+            continue;
+        }
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        printf("New connection from %s on socket %d\n", client_ip, client_fd);
+    }
+}
+
+void *reactor_run(void *arg) {
+    Reactor *r = arg;
+
+    if (r->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            fprintf(stderr, "WARNING: could not pin reactor to CPU %d\n", r->cpu);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        // Wake up every tick only while there are timers to run
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, r->timers.count > 0 ? TIMER_TICK_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("ERROR in epoll_wait");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if (conn == NULL) {
+                // New connections
+                accept_connections(r);
+            } else if ((void *)conn == &r->docroot) {
+                // Files in the document root changed
+                docroot_refresh(&r->docroot);
+            } else {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    conn->state = CONN_CLOSED;
+                }
+                handle_client(conn);
+            }
+        }
+
+        expire_connections(r);
+    }
+    return NULL;
+}
+
+// Creates a non-blocking listening socket. With reuseport several sockets
+// can bind the same port and the kernel load-balances connections.
+int create_listener(int port, int reuseport) {
+    int server_fd;
+    struct sockaddr_in server_addr;
 
     // Create socket
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("ERROR opening socket");
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Set socket options
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        (reuseport && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         perror("ERROR setting socket options");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Bind socket
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(port);
     if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("ERROR binding socket");
         close(server_fd);
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
     // Listen for connections
-    if (listen(server_fd, 10) < 0) {
+    if (listen(server_fd, admission->backlog) < 0) {
         perror("ERROR listening on socket");
         close(server_fd);
+        return -1;
+    }
+
+    if (set_nonblocking(server_fd) < 0) {
+        perror("ERROR setting non-blocking mode");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// Lift the soft descriptor limit to the hard limit so the loop is not
+// capped at the default 1024 open files.
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int first = admission_init(argc, argv);
+    if (first < 0 || argc - first < 2) {
+        fprintf(stderr, "Usage: %s [options] <port> <root_directory> [reactors] [pin]\n", argv[0]);
+        fprintf(stderr, "  reactors: event loop threads, 0 for one per CPU (default 1)\n");
+        fprintf(stderr, "  pin:      pin reactor i to CPU i\n");
+        fprintf(stderr, "%s", ADMISSION_USAGE);
+        exit(1);
+    }
+    argc -= first - 1;
+    argv += first - 1;  // argv[1] is the port from here on
+
+    int port = atoi(argv[1]);
+    ROOT = argv[2];
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nreactors = argc > 3 ? atoi(argv[3]) : 1;
+    if (nreactors <= 0) {
+        nreactors = ncpus > 0 ? ncpus : 1;
+    }
+    int pin = argc > 4 && strcmp(argv[4], "pin") == 0;
+
+    // Ensure ROOT is a directory, not a file
+    struct stat root_stat;
+    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode)) {
+        fprintf(stderr, "ERROR: Root directory is not valid\n");
+        exit(1);
+    }
+
+    raise_fd_limit();
+    if (stats_init() < 0) perror("ERROR mapping statistics");
+    signal(SIGPIPE, SIG_IGN);  // a vanished client must not kill the server
+
+    Reactor *reactors = calloc(nreactors, sizeof(Reactor));
+    if (reactors == NULL) {
+        perror("ERROR allocating reactors");
         exit(EXIT_FAILURE);
     }
 
-    // Initialize fd sets
-    FD_ZERO(&master_fds);
-    FD_ZERO(&read_fds);
-    FD_SET(server_fd, &master_fds);
-    fd_max = server_fd;
+    for (int i = 0; i < nreactors; i++) {
+        Reactor *r = &reactors[i];
+        r->cpu = pin ? i % ncpus : -1;
+        if (docroot_init(&r->docroot, ROOT) < 0) {
+            perror("ERROR opening root directory");
+            exit(EXIT_FAILURE);
+        }
+        file_cache_init(&r->cache, r->docroot.dir_fd);
+        wheel_init(&r->timers, now_ticks());
+        slab_pool_init(&r->connections, sizeof(Connection), POOL_SLAB_OBJECTS);
+        slab_pool_init(&r->buffers, RESPONSE_ARENA_SIZE, POOL_SLAB_OBJECTS);
+
+        if ((r->listen_fd = create_listener(port, nreactors > 1)) < 0) {
+            exit(EXIT_FAILURE);
+        }
 
-    printf("Server is listening on port %d with root directory %s\n", port, ROOT);
+        // Create the epoll instance; the listener is tagged with a NULL pointer
+        if ((r->epoll_fd = epoll_create1(0)) < 0) {
+            perror("ERROR creating epoll instance");
+            exit(EXIT_FAILURE);
+        }
 
-    while (1) {
-        read_fds = master_fds;
-        if (select(fd_max + 1, &read_fds, NULL, NULL, NULL) < 0) {
-            perror("ERROR in select");
-            close(server_fd);
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+            perror("ERROR adding listener to epoll");
             exit(EXIT_FAILURE);
         }
 
-        for (int i = 0; i <= fd_max; i++) {
-            if (FD_ISSET(i, &read_fds)) {
-                if (i == server_fd) {
-                    // New connection
-                    if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_len)) < 0) {
-                        perror("ERROR accepting connection");
-                        continue;
-                    }
-                    FD_SET(client_fd, &master_fds);
-                    if (client_fd > fd_max) {
-                        fd_max = client_fd;
-                    }
-                    printf("New connection from %s on socket %d\n", inet_ntoa(client_addr.sin_addr), client_fd);
-                } else {
-                    // Handle client
-                    handle_client(i);
-                    FD_CLR(i, &master_fds);
-                }
-            }
+        // inotify reports changes in the document root; tagged with the index
+        ev.events = EPOLLIN;
+        ev.data.ptr = &r->docroot;
+        if (docroot_notify_fd(&r->docroot) < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->docroot.notify_fd, &ev) < 0) {
+            perror("ERROR watching root directory");
+            exit(EXIT_FAILURE);
         }
     }
 
-    close(server_fd);
+    printf("Server is listening on port %d with root directory %s (%d reactor%s)\n",
+           port, ROOT, nreactors, nreactors > 1 ? "s" : "");
+
+    // The main thread runs the first reactor itself
+    for (int i = 1; i < nreactors; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, reactor_run, &reactors[i]) != 0) {
+            perror("ERROR creating reactor thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    reactor_run(&reactors[0]);
     return 0;
-}
\ No newline at end of file
+}
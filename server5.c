@@ -0,0 +1,702 @@
+/* server5.c
+ * Single-threaded server driven entirely by io_uring (raw syscalls, no
+ * liburing), so every step of a request is queued on the ring instead of
+ * being its own system call:
+ *
+ *  - one multishot accept keeps producing connections, installed straight
+ *    into the ring's fixed file table rather than as ordinary descriptors;
+ *  - each connection owns a slice of one registered buffer, used for
+ *    reading the request and for building the response;
+ *  - a file is answered with openat2, then statx of the opened file, then
+ *    the linked chain read -> write -> close. Paths are resolved beneath
+ *    the document root (RESOLVE_BENEATH) before anything is looked at, so
+ *    ".." and symlinks cannot lead out of it, nor reveal what lies outside.
+ *
+ * Everything prepared while handling a batch of completions goes to the
+ * kernel with the next io_uring_enter(), which also waits for more
+ * completions. Interrupting the server prints how many io_uring_enter
+ * calls it made per request.
+ */
+#define _GNU_SOURCE  // struct statx
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/io_uring.h>
+#include <linux/openat2.h>
+
+#include "http_parser.h"
+#include "mime_types.h"
+
+#define MAX_CONNECTIONS 256    // fixed socket slots; accept pauses while all are taken
+#define IN_BUFFER_SIZE HTTP_MAX_HEAD  // request bytes buffered per connection
+#define OUT_BUFFER_SIZE 16384  // response header plus one chunk of file data
+#define RING_ENTRIES 1024
+#define KEEPALIVE_TIMEOUT 5    // seconds an idle connection is kept open
+#define HEADER_TIMEOUT 10      // seconds to finish a request head once it has begun
+#define KEEPALIVE_MAX 100      // requests served before the connection is closed
+
+char *ROOT;  // Diretório raiz para os arquivos
+int root_fd;  // ROOT, which request paths are resolved beneath
+
+static const struct open_how open_beneath = {
+    .flags = O_RDONLY | O_CLOEXEC,
+    .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+};
+
+// Operation in the low byte of a request's user_data; the rest is the
+// connection's slot
+enum {
+    OP_ACCEPT,
+    OP_READ,
+    OP_TIMEOUT,
+    OP_STATX,
+    OP_OPEN,
+    OP_FILE_READ,
+    OP_WRITE,
+    OP_CLOSE_FILE,
+    OP_CLOSE
+};
+
+// What a connection is waiting for. A connection only has one batch of
+// linked operations in flight at a time; when the last of them completes
+// the phase decides what to submit next.
+typedef enum {
+    PHASE_READING,   // request bytes, with a linked keep-alive timeout
+    PHASE_OPEN,      // openat2 of the requested file
+    PHASE_STAT,      // statx of the opened file
+    PHASE_SENDING,   // header, file chunks and the file's close
+    PHASE_CLOSING    // closes of the socket and file slots
+} Phase;
+
+typedef struct {
+    int active;
+    Phase phase;
+    int inflight;      // submitted operations not yet completed
+    int failed;        // an operation in the current batch failed
+    int keep_alive;    // whether the current response leaves the connection open
+    int requests;      // requests served on this connection so far
+    char *in;          // IN_BUFFER_SIZE bytes of the registered buffer
+    size_t in_len;
+    http_request req;  // parser state for the request at the front of in
+    char *out;         // OUT_BUFFER_SIZE bytes of the registered buffer
+    size_t out_len;
+    size_t out_sent;
+    int file_open;     // file_fd holds an open file
+    int file_fd;       // the file being sent
+    int open_error;    // errno of a failed openat2
+    int stat_error;    // errno of a failed statx
+    off_t file_off;    // file bytes already read into out
+    off_t file_size;
+    size_t chunk;      // bytes the pending file read must return
+    char filepath[512];  // relative to root_fd
+    struct statx stx;
+    struct __kernel_timespec timeout;
+    struct __kernel_timespec head_deadline;  // CLOCK_MONOTONIC; tv_sec is 0 until the request head begins
+} Connection;
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;  // local tail, published by ring_submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned long enters;  // io_uring_enter calls so far
+} Ring;
+
+Ring ring;
+Connection connections[MAX_CONNECTIONS];
+int listen_fd;
+int accept_paused;           // every slot was taken when accept last failed
+unsigned long requests_served;
+volatile sig_atomic_t stop;
+
+int ring_enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+    ring.enters++;
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Hands every prepared SQE to the kernel and, if wait is set, blocks until
+// at least one completion is available. Returns -1 on EINTR.
+int ring_submit(int wait) {
+    unsigned to_submit = ring.sqe_tail - *ring.sq_tail;
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+    int n = ring_enter(to_submit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (n < 0 && errno != EINTR) {
+        perror("ERROR in io_uring_enter");
+        exit(EXIT_FAILURE);
+    }
+    return n < 0 ? -1 : 0;
+}
+
+struct io_uring_sqe *ring_get_sqe(void) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    while (ring.sqe_tail - head >= ring.sq_entries) {
+        // Submission queue full: flush it without waiting
+        ring_submit(0);
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned index = ring.sqe_tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.sqe_tail++;
+    return sqe;
+}
+
+// Prepares an operation for connection slot; LINK chains it to the next one.
+struct io_uring_sqe *queue_op(int slot, int op, int opcode, int flags) {
+    struct io_uring_sqe *sqe = ring_get_sqe();
+    sqe->opcode = opcode;
+    sqe->flags = flags;
+    sqe->user_data = ((uint64_t)slot << 8) | op;
+    if (slot >= 0) {
+        connections[slot].inflight++;
+    }
+    return sqe;
+}
+
+int ring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = RING_ENTRIES * 4;
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (ring.fd < 0 && errno == EINVAL) {
+        // Kernels before 5.19 do not know COOP_TASKRUN
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = RING_ENTRIES * 4;
+        ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    }
+    if (ring.fd < 0) {
+        perror("ERROR setting up io_uring");
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+    if (sq != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring.fd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+        perror("ERROR mapping io_uring");
+        return -1;
+    }
+
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sqe_tail = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Registers the connection buffers and a sparse fixed file table for the
+// accepted sockets. Files stay ordinary descriptors: statx cannot take a
+// fixed file, and the file has to be statted after it is opened.
+int ring_register(void) {
+    size_t per_conn = IN_BUFFER_SIZE + OUT_BUFFER_SIZE;
+    char *arena = mmap(NULL, MAX_CONNECTIONS * per_conn, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena == MAP_FAILED) {
+        perror("ERROR allocating buffers");
+        return -1;
+    }
+    struct iovec iov[MAX_CONNECTIONS];
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connections[i].in = arena + i * per_conn;
+        connections[i].out = connections[i].in + IN_BUFFER_SIZE;
+        iov[i].iov_base = connections[i].in;
+        iov[i].iov_len = per_conn;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, MAX_CONNECTIONS) < 0) {
+        perror("ERROR registering buffers");
+        return -1;
+    }
+
+    int files[MAX_CONNECTIONS];
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        files[i] = -1;
+    }
+    struct io_uring_file_index_range range = { .off = 0, .len = MAX_CONNECTIONS };
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, files, MAX_CONNECTIONS) < 0 ||
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILE_ALLOC_RANGE, &range, 0) < 0) {
+        perror("ERROR registering files");
+        return -1;
+    }
+    return 0;
+}
+
+void queue_accept(void) {
+    struct io_uring_sqe *sqe = queue_op(-1, OP_ACCEPT, IORING_OP_ACCEPT, 0);
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+}
+
+// Reads more of the request. Waiting for one gives up after
+// KEEPALIVE_TIMEOUT; once its head has begun it must be complete
+// HEADER_TIMEOUT after the first byte, however slowly the rest trickles in.
+void queue_read(int slot) {
+    Connection *conn = &connections[slot];
+    struct io_uring_sqe *sqe = queue_op(slot, OP_READ, IORING_OP_READ_FIXED,
+                                        IOSQE_FIXED_FILE | IOSQE_IO_LINK);
+    sqe->fd = slot;
+    sqe->addr = (uint64_t)(conn->in + conn->in_len);
+    sqe->len = IN_BUFFER_SIZE - conn->in_len;
+    sqe->buf_index = slot;
+
+    sqe = queue_op(slot, OP_TIMEOUT, IORING_OP_LINK_TIMEOUT, 0);
+    if (conn->in_len == 0) {
+        conn->timeout.tv_sec = KEEPALIVE_TIMEOUT;
+        conn->timeout.tv_nsec = 0;
+    } else {
+        if (conn->head_deadline.tv_sec == 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            conn->head_deadline.tv_sec = now.tv_sec + HEADER_TIMEOUT;
+            conn->head_deadline.tv_nsec = now.tv_nsec;
+        }
+        conn->timeout = conn->head_deadline;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+    }
+    sqe->addr = (uint64_t)&conn->timeout;
+    sqe->len = 1;
+    conn->phase = PHASE_READING;
+}
+
+// Sends out[out_sent, out_len); with flags LINK the next operation waits for it.
+void queue_write(int slot, int flags) {
+    Connection *conn = &connections[slot];
+    struct io_uring_sqe *sqe = queue_op(slot, OP_WRITE, IORING_OP_WRITE_FIXED, IOSQE_FIXED_FILE | flags);
+    sqe->fd = slot;
+    sqe->addr = (uint64_t)(conn->out + conn->out_sent);
+    sqe->len = conn->out_len - conn->out_sent;
+    sqe->buf_index = slot;
+    conn->phase = PHASE_SENDING;
+}
+
+void queue_close_file(int slot, int flags) {
+    struct io_uring_sqe *sqe = queue_op(slot, OP_CLOSE_FILE, IORING_OP_CLOSE, flags);
+    sqe->fd = connections[slot].file_fd;
+}
+
+// Reads the next chunk of the file right behind whatever out already holds
+// and links its write (and, for the last chunk, the close of the file).
+void queue_file_chunk(int slot, int flags) {
+    Connection *conn = &connections[slot];
+    size_t room = OUT_BUFFER_SIZE - conn->out_len;
+    off_t left = conn->file_size - conn->file_off;
+    conn->chunk = left < (off_t)room ? (size_t)left : room;
+
+    struct io_uring_sqe *sqe = queue_op(slot, OP_FILE_READ, IORING_OP_READ_FIXED, IOSQE_IO_LINK | flags);
+    sqe->fd = conn->file_fd;
+    sqe->addr = (uint64_t)(conn->out + conn->out_len);
+    sqe->len = conn->chunk;
+    sqe->off = conn->file_off;
+    sqe->buf_index = slot;
+
+    conn->out_len += conn->chunk;
+    int last = conn->file_off + (off_t)conn->chunk == conn->file_size;
+    queue_write(slot, last ? IOSQE_IO_LINK : 0);
+    if (last) {
+        queue_close_file(slot, 0);
+    }
+}
+
+void close_connection(int slot) {
+    Connection *conn = &connections[slot];
+    if (conn->file_open) {
+        queue_close_file(slot, 0);
+    }
+    struct io_uring_sqe *sqe = queue_op(slot, OP_CLOSE, IORING_OP_CLOSE, 0);
+    sqe->file_index = slot + 1;
+    conn->phase = PHASE_CLOSING;
+}
+
+// Formats the response header into out; content_length bytes of body follow.
+void format_header(Connection *conn, const char *status, const char *content_type, off_t content_length) {
+    conn->out_len = snprintf(conn->out, OUT_BUFFER_SIZE,
+                             "HTTP/1.1 %s\r\n"
+                             "Content-Type: %s\r\n"
+                             "Content-Length: %lld\r\n"
+                             "Connection: %s\r\n"
+                             "\r\n",
+                             status, content_type, (long long)content_length,
+                             conn->keep_alive ? "keep-alive" : "close");
+    conn->out_sent = 0;
+}
+
+void send_error(int slot, const char *status, const char *body) {
+    Connection *conn = &connections[slot];
+    size_t body_len = strlen(body);
+    format_header(conn, status, "text/plain", body_len);
+    memcpy(conn->out + conn->out_len, body, body_len);
+    conn->out_len += body_len;
+    conn->file_size = conn->file_off = 0;
+    queue_write(slot, 0);
+}
+
+// Builds the response for the request parsed into conn->req.
+void build_response(int slot) {
+    Connection *conn = &connections[slot];
+    const http_request *req = &conn->req;
+    conn->keep_alive = conn->requests < KEEPALIVE_MAX && http_wants_keep_alive(req);
+
+    // Only handle GET requests; a request body would desync the stream
+    if (!http_slice_eq(req->method, "GET")) {
+        conn->keep_alive = 0;
+        send_error(slot, "405 Method Not Allowed", "Method Not Allowed");
+        return;
+    }
+
+    // Construct the file path relative to the root
+    const char *path = req->path.ptr;
+    size_t len = req->path.len;
+    while (len > 0 && *path == '/') {
+        path++;
+        len--;
+    }
+    if (len == 0) {
+        snprintf(conn->filepath, sizeof(conn->filepath), "index.html");
+    } else if (snprintf(conn->filepath, sizeof(conn->filepath), "%.*s", (int)len, path) >= (int)sizeof(conn->filepath)) {
+        send_error(slot, "414 URI Too Long", "URI Too Long");
+        return;
+    }
+
+    // Open first: only the open confines the path, so nothing about a path
+    // leading out of the root is looked at, and it is answered with 404
+    conn->open_error = 0;
+    struct io_uring_sqe *sqe = queue_op(slot, OP_OPEN, IORING_OP_OPENAT2, 0);
+    sqe->fd = root_fd;
+    sqe->addr = (uint64_t)conn->filepath;
+    sqe->addr2 = (uint64_t)&open_beneath;
+    sqe->len = sizeof(open_beneath);
+    conn->phase = PHASE_OPEN;
+}
+
+// Stats the file just opened.
+void stat_file(int slot) {
+    Connection *conn = &connections[slot];
+    if (conn->open_error != 0) {
+        send_error(slot, "404 Not Found", "File Not Found");
+        return;
+    }
+    conn->stat_error = 0;
+    struct io_uring_sqe *sqe = queue_op(slot, OP_STATX, IORING_OP_STATX, 0);
+    sqe->fd = conn->file_fd;
+    sqe->addr = (uint64_t)"";
+    sqe->statx_flags = AT_EMPTY_PATH;
+    sqe->len = STATX_TYPE | STATX_SIZE;
+    sqe->off = (uint64_t)&conn->stx;
+    conn->phase = PHASE_STAT;
+}
+
+// Queues the header and the file: read -> write (-> close).
+void send_file(int slot) {
+    Connection *conn = &connections[slot];
+    if (conn->stat_error != 0 || !S_ISREG(conn->stx.stx_mode)) {
+        queue_close_file(slot, 0);
+        if (conn->stat_error == 0 && S_ISDIR(conn->stx.stx_mode)) {
+            send_error(slot, "403 Forbidden", "Forbidden: Is a directory");
+        } else {
+            send_error(slot, "404 Not Found", "File Not Found");
+        }
+        return;
+    }
+
+    conn->file_size = conn->stx.stx_size;
+    conn->file_off = 0;
+    format_header(conn, "200 OK", mime_type_for(conn->filepath), conn->file_size);
+    if (conn->file_size == 0) {
+        queue_write(slot, IOSQE_IO_LINK);
+        queue_close_file(slot, 0);
+        return;
+    }
+    queue_file_chunk(slot, 0);
+}
+
+// Parses the buffered input and starts the next response, or reads more.
+void process_input(int slot) {
+    Connection *conn = &connections[slot];
+    int head_len = http_parse_request(&conn->req, conn->in, conn->in_len);
+    if (head_len == HTTP_PARSE_INCOMPLETE) {
+        if (conn->in_len == IN_BUFFER_SIZE) {
+            conn->keep_alive = 0;
+            send_error(slot, "431 Request Header Fields Too Large", "Request Header Fields Too Large");
+        } else {
+            queue_read(slot);
+        }
+        return;
+    }
+    if (head_len == HTTP_PARSE_ERROR) {
+        conn->keep_alive = 0;
+        send_error(slot, "400 Bad Request", "Bad Request");
+        return;
+    }
+
+    build_response(slot);
+
+    // filepath holds its own copy of the path, so the request can go
+    memmove(conn->in, conn->in + head_len, conn->in_len - head_len);
+    conn->in_len -= head_len;
+    conn->requests++;
+    conn->head_deadline.tv_sec = 0;
+    http_request_init(&conn->req);
+}
+
+// Called once every operation of the connection's last batch completed.
+void advance(int slot) {
+    Connection *conn = &connections[slot];
+    if (conn->phase == PHASE_CLOSING) {
+        conn->active = 0;
+        if (accept_paused) {
+            accept_paused = 0;
+            queue_accept();
+        }
+        return;
+    }
+    if (conn->failed) {
+        close_connection(slot);
+        return;
+    }
+
+    switch (conn->phase) {
+    case PHASE_READING:
+        process_input(slot);
+        break;
+    case PHASE_OPEN:
+        stat_file(slot);
+        break;
+    case PHASE_STAT:
+        send_file(slot);
+        break;
+    case PHASE_SENDING:
+        if (conn->out_sent < conn->out_len) {
+            // Short write
+            queue_write(slot, 0);
+        } else if (conn->file_off < conn->file_size) {
+            conn->out_len = conn->out_sent = 0;
+            queue_file_chunk(slot, 0);
+        } else if (conn->file_open) {
+            // The close was cancelled by a short write earlier in the chain
+            queue_close_file(slot, 0);
+        } else {
+            requests_served++;
+            if (conn->keep_alive) {
+                process_input(slot);
+            } else {
+                close_connection(slot);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void handle_completion(struct io_uring_cqe *cqe) {
+    int op = cqe->user_data & 0xff;
+    int slot = (int)(cqe->user_data >> 8);
+    int res = cqe->res;
+
+    if (op == OP_ACCEPT) {
+        if (res >= 0) {
+            Connection *conn = &connections[res];
+            conn->active = 1;
+            conn->inflight = conn->failed = 0;
+            conn->requests = 0;
+            conn->in_len = 0;
+            conn->head_deadline.tv_sec = 0;
+            conn->file_open = 0;
+            http_request_init(&conn->req);
+            queue_read(res);
+        } else if (res == -ENFILE) {
+            // Every slot is in use; accept again once one is freed
+            accept_paused = 1;
+        } else {
+            errno = -res;
+            perror("ERROR accepting connection");
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !accept_paused) {
+            queue_accept();
+        }
+        return;
+    }
+
+    Connection *conn = &connections[slot];
+    switch (op) {
+    case OP_READ:
+        if (res > 0) {
+            conn->in_len += res;
+        } else {
+            // Peer closed, error, or cancelled by the keep-alive timeout
+            conn->failed = 1;
+        }
+        break;
+    case OP_STATX:
+        conn->stat_error = res < 0 ? -res : 0;
+        break;
+    case OP_OPEN:
+        if (res < 0) {
+            conn->open_error = -res;
+        } else {
+            conn->file_fd = res;
+            conn->file_open = 1;
+        }
+        break;
+    case OP_FILE_READ:
+        if (res == (int)conn->chunk) {
+            conn->file_off += res;
+        } else if (res != -ECANCELED) {
+            // The file shrank underneath us: the length we announced can no
+            // longer be honoured
+            conn->failed = 1;
+        }
+        break;
+    case OP_WRITE:
+        if (res > 0) {
+            conn->out_sent += res;
+        } else if (res != -ECANCELED) {
+            conn->failed = 1;
+        }
+        break;
+    case OP_CLOSE_FILE:
+        if (res != -ECANCELED) {
+            conn->file_open = 0;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (--conn->inflight == 0) {
+        advance(slot);
+    }
+}
+
+int create_listener(int port) {
+    int server_fd;
+    struct sockaddr_in server_addr;
+
+    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("ERROR opening socket");
+        return -1;
+    }
+    int opt = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("ERROR setting socket options");
+        close(server_fd);
+        return -1;
+    }
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+    server_addr.sin_port = htons(port);
+    if (bind(server_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("ERROR binding socket");
+        close(server_fd);
+        return -1;
+    }
+    if (listen(server_fd, SOMAXCONN) < 0) {
+        perror("ERROR listening on socket");
+        close(server_fd);
+        return -1;
+    }
+    return server_fd;
+}
+
+// Registered buffers count against RLIMIT_MEMLOCK.
+void raise_memlock_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_MEMLOCK, &rl);
+    }
+}
+
+void request_stop(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <port> <root_directory>\n", argv[0]);
+        exit(1);
+    }
+
+    int port = atoi(argv[1]);
+    ROOT = argv[2];
+
+    // Ensure ROOT is a directory, not a file
+    struct stat root_stat;
+    if (stat(ROOT, &root_stat) < 0 || !S_ISDIR(root_stat.st_mode) ||
+        (root_fd = open(ROOT, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "ERROR: Root directory is not valid\n");
+        exit(1);
+    }
+
+    raise_memlock_limit();
+    signal(SIGPIPE, SIG_IGN);  // a vanished client must not kill the server
+
+    // No SA_RESTART: the signal has to interrupt io_uring_enter
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if ((listen_fd = create_listener(port)) < 0 || ring_setup() < 0 || ring_register() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Server is listening on port %d with root directory %s (io_uring)\n", port, ROOT);
+    fflush(stdout);
+
+    queue_accept();
+    while (!stop) {
+        if (ring_submit(1) < 0) {
+            continue;
+        }
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            handle_completion(&ring.cqes[head & *ring.cq_mask]);
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    printf("Served %lu requests with %lu io_uring_enter calls (%.2f per request)\n",
+           requests_served, ring.enters, requests_served ? (double)ring.enters / requests_served : 0.0);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/* spsc_ring.h
+ * Bounded lock-free single-producer/single-consumer ring of pointers, used
+ * by the shards of select.c to pass messages to each other.
+ *
+ * With one thread on each side no compare-and-swap is needed: the producer
+ * alone advances head and the consumer alone advances tail, each publishing
+ * its index with a release store the other side reads with acquire. Each
+ * side also keeps a private copy of the other's index and only reloads it
+ * when the ring looks full (or empty), so the shared cache lines move
+ * between cores once per batch rather than once per item. The ring never
+ * blocks; how to wait is up to the caller (select.c uses an eventfd).
+ */
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+typedef struct {
+    void **slots;
+    size_t mask;
+    _Alignas(64) _Atomic size_t head;  // next position to push
+    size_t tail_seen;                  // producer's copy of tail
+    _Alignas(64) _Atomic size_t tail;  // next position to pop
+    size_t head_seen;                  // consumer's copy of head
+} spsc_ring;
+
+/* capacity is rounded up to a power of two. Returns -1 on allocation failure. */
+static inline int spsc_init(spsc_ring *ring, size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    ring->slots = malloc(size * sizeof(void *));
+    if (ring->slots == NULL) {
+        return -1;
+    }
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->tail_seen = 0;
+    ring->head_seen = 0;
+    return 0;
+}
+
+/* Producer side. Returns 0 if the ring is full. */
+static inline int spsc_push(spsc_ring *ring, void *value) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - ring->tail_seen > ring->mask) {
+        ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_seen > ring->mask) {
+            return 0;
+        }
+    }
+    ring->slots[head & ring->mask] = value;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+/* Consumer side. Returns NULL if the ring is empty. */
+static inline void *spsc_pop(spsc_ring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == ring->head_seen) {
+        ring->head_seen = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail == ring->head_seen) {
+            return NULL;
+        }
+    }
+    void *value = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return value;
+}
+
+#endif
@@ -0,0 +1,370 @@
+/* stats.h
+ * Request counters and per-stage latency histograms shared by the server
+ * variants, served on STATS_PATH as text or, with ?format=prometheus, in
+ * the Prometheus exposition format.
+ *
+ * Every thread (or forked process) records into a shard of its own, so
+ * recording takes no lock and no atomic read-modify-write: the owner is
+ * the only writer and uses relaxed loads and stores. Shards are only added
+ * up when the endpoint is scraped. They live in a shared anonymous mapping
+ * set up by stats_init() before the server forks or starts threads, so
+ * children of the fork-based server report into the same place. A process
+ * or thread that finishes folds its shard into the retired totals with
+ * stats_release(), and stats_reclaim() does the same for a process that
+ * died without doing so. When all STATS_MAX_SHARDS shards are taken, further
+ * threads go unrecorded.
+ *
+ * Latencies use log-linear buckets laid out like loadgen.c's but coarser,
+ * to keep each shard small: STATS_SUB_BITS is 5 where loadgen.c uses 7, so
+ * a bucket spans up to about 6% of its value against loadgen.c's 1.6%, and
+ * percentiles from the two differ by up to that much. Resolution is
+ * nanoseconds. The stages are:
+ *   first_byte  accept until the first response starts going out
+ *   parse       parsing the request head
+ *   file        resolving the path and fetching the body from the cache
+ *   send        writing the response out
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "http_parser.h"
+
+#define STATS_PATH "/__stats"
+#define STATS_MAX_SHARDS 256
+#define STATS_SUB_BITS 5                        // 32 sub-buckets per power of two
+#define STATS_SUB (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS (STATS_SUB + (64 - STATS_SUB_BITS) * (STATS_SUB / 2))
+
+enum {
+    STATS_CONNECTIONS,
+    STATS_REQUESTS,
+    STATS_CACHE_HITS,
+    STATS_CACHE_MISSES,
+    STATS_SHED,                                  // turned away by admission control
+    STATS_STATUS_1XX,                            // STATS_STATUS_1XX + class - 1
+    STATS_STATUS_2XX,
+    STATS_STATUS_3XX,
+    STATS_STATUS_4XX,
+    STATS_STATUS_5XX,
+    STATS_NUM_COUNTERS
+};
+
+enum {
+    STATS_FIRST_BYTE,
+    STATS_PARSE,
+    STATS_FILE,
+    STATS_SEND,
+    STATS_NUM_STAGES
+};
+
+static const char *const stats_counter_names[STATS_NUM_COUNTERS] = {
+    "connections", "requests", "cache_hits", "cache_misses", "shed",
+    "responses_1xx", "responses_2xx", "responses_3xx", "responses_4xx", "responses_5xx",
+};
+static const char *const stats_stage_names[STATS_NUM_STAGES] = { "first_byte", "parse", "file", "send" };
+
+typedef struct {
+    uint64_t counts[STATS_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} stats_histogram;
+
+typedef struct {
+    int in_use;
+    pid_t owner;
+    uint64_t counters[STATS_NUM_COUNTERS];
+    stats_histogram stages[STATS_NUM_STAGES];
+} stats_shard;
+
+typedef struct {
+    time_t started;
+    stats_shard retired;     // shards given back, added up
+    stats_shard shards[STATS_MAX_SHARDS];
+} stats_registry;
+
+static stats_registry *stats_shared;
+static __thread stats_shard *stats_local;
+static __thread int stats_claimed;           // stats_local was looked for
+
+static inline uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Call once before forking or starting threads. Returns 0, or -1 if the
+// mapping fails, in which case nothing is recorded.
+static inline int stats_init(void) {
+    void *p = mmap(NULL, sizeof(stats_registry), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    stats_shared = p;
+    stats_shared->started = time(NULL);
+    return 0;
+}
+
+// The calling thread's shard, claimed on first use; NULL if none is left.
+static inline stats_shard *stats_shard_local(void) {
+    if (!stats_claimed && stats_shared != NULL) {
+        stats_claimed = 1;
+        for (int i = 0; i < STATS_MAX_SHARDS; i++) {
+            int expected = 0;
+            if (__atomic_compare_exchange_n(&stats_shared->shards[i].in_use, &expected, 1, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                stats_local = &stats_shared->shards[i];
+                stats_local->owner = getpid();
+                break;
+            }
+        }
+    }
+    return stats_local;
+}
+
+// Adds to a value only this thread writes
+static inline void stats_bump(uint64_t *p, uint64_t n) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void stats_count(int counter) {
+    stats_shard *s = stats_shard_local();
+    if (s != NULL) {
+        stats_bump(&s->counters[counter], 1);
+    }
+}
+
+// Counts a response by the class of its status line ("404 Not Found").
+static inline void stats_status(const char *status) {
+    if (status[0] >= '1' && status[0] <= '5') {
+        stats_count(STATS_STATUS_1XX + status[0] - '1');
+    }
+}
+
+static inline int stats_bucket(uint64_t v) {
+    if (v < STATS_SUB) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - STATS_SUB_BITS + 1;
+    return STATS_SUB + (shift - 1) * (STATS_SUB / 2) + (int)((v >> shift) - STATS_SUB / 2);
+}
+
+// Upper edge of a bucket, so reported percentiles never understate latency.
+static inline uint64_t stats_bucket_value(int index) {
+    if (index < STATS_SUB) {
+        return index;
+    }
+    int k = index - STATS_SUB;
+    int shift = k / (STATS_SUB / 2) + 1;
+    uint64_t sub = k % (STATS_SUB / 2) + STATS_SUB / 2;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void stats_record(int stage, uint64_t ns) {
+    stats_shard *s = stats_shard_local();
+    if (s == NULL) {
+        return;
+    }
+    stats_histogram *h = &s->stages[stage];
+    stats_bump(&h->counts[stats_bucket(ns)], 1);
+    stats_bump(&h->total, 1);
+    stats_bump(&h->sum, ns);
+    if (ns > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+// Records the time since *start for a stage and moves *start to now.
+static inline void stats_stage_end(int stage, uint64_t *start) {
+    uint64_t now = stats_now();
+    stats_record(stage, now - *start);
+    *start = now;
+}
+
+// Adds *src to *dst. With atomic set, *dst may have other writers.
+static inline void stats_merge_value(uint64_t *dst, const uint64_t *src, int atomic) {
+    uint64_t v = __atomic_load_n(src, __ATOMIC_RELAXED);
+    if (atomic) {
+        __atomic_fetch_add(dst, v, __ATOMIC_RELAXED);
+    } else {
+        *dst += v;
+    }
+}
+
+static inline void stats_merge_histogram(stats_histogram *dst, const stats_histogram *src, int atomic) {
+    if (__atomic_load_n(&src->total, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        stats_merge_value(&dst->counts[b], &src->counts[b], atomic);
+    }
+    stats_merge_value(&dst->total, &src->total, atomic);
+    stats_merge_value(&dst->sum, &src->sum, atomic);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    uint64_t cur = __atomic_load_n(&dst->max, __ATOMIC_RELAXED);
+    while (max > cur && !__atomic_compare_exchange_n(&dst->max, &cur, max, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+static inline void stats_merge(stats_shard *into, const stats_shard *from, int atomic) {
+    for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+        stats_merge_value(&into->counters[i], &from->counters[i], atomic);
+    }
+    for (int i = 0; i < STATS_NUM_STAGES; i++) {
+        stats_merge_histogram(&into->stages[i], &from->stages[i], atomic);
+    }
+}
+
+static inline void stats_retire(stats_shard *s) {
+    stats_merge(&stats_shared->retired, s, 1);
+    memset(s->counters, 0, sizeof(s->counters));
+    memset(s->stages, 0, sizeof(s->stages));
+    __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Folds the calling thread's shard into the retired totals and frees it.
+static inline void stats_release(void) {
+    if (stats_local != NULL) {
+        stats_retire(stats_local);
+    }
+    stats_local = NULL;
+    stats_claimed = 0;
+}
+
+// Call in a child right after fork(). The child would otherwise inherit the
+// parent's claim and record into the parent's shard, which is not its own to
+// write or to release; it claims a fresh one on first use instead.
+static inline void stats_after_fork(void) {
+    stats_local = NULL;
+    stats_claimed = 0;
+}
+
+// Retires the shards of a child process that has exited; call after
+// reaping it.
+static inline void stats_reclaim(pid_t pid) {
+    if (stats_shared == NULL) {
+        return;
+    }
+    for (int i = 0; i < STATS_MAX_SHARDS; i++) {
+        stats_shard *s = &stats_shared->shards[i];
+        if (__atomic_load_n(&s->in_use, __ATOMIC_ACQUIRE) && s->owner == pid) {
+            stats_retire(s);
+        }
+    }
+}
+
+// Adds up one stage over every shard into h, which starts out zeroed.
+static inline void stats_stage_total(int stage, stats_histogram *h) {
+    if (stats_shared == NULL) {
+        return;
+    }
+    stats_merge_histogram(h, &stats_shared->retired.stages[stage], 0);
+    for (int i = 0; i < STATS_MAX_SHARDS; i++) {
+        if (__atomic_load_n(&stats_shared->shards[i].in_use, __ATOMIC_ACQUIRE)) {
+            stats_merge_histogram(h, &stats_shared->shards[i].stages[stage], 0);
+        }
+    }
+}
+
+static inline uint64_t stats_percentile(const stats_histogram *h, double p) {
+    uint64_t target = (uint64_t)(h->total * p / 100.0 + 0.5);
+    if (target == 0) {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = stats_bucket_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Returns how a request for path wants the statistics: 1 as text, 2 in the
+ * Prometheus format, or 0 when it is not a request for them. */
+static inline int stats_requested(http_slice path) {
+    if (http_slice_eq(path, STATS_PATH)) {
+        return 1;
+    }
+    return http_slice_eq(path, STATS_PATH "?format=prometheus") ? 2 : 0;
+}
+
+/* Adds up all shards and renders them as asked by stats_requested().
+ * Returns a malloc'ed body and stores its length, or NULL. A shard being
+ * released during the scrape may be counted twice. */
+static inline char *stats_render(int format, size_t *len) {
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    stats_shard *total = calloc(1, sizeof(stats_shard));
+    char *body = NULL;
+    FILE *out = total != NULL && stats_shared != NULL ? open_memstream(&body, len) : NULL;
+    if (out == NULL) {
+        free(total);
+        return NULL;
+    }
+    stats_merge(total, &stats_shared->retired, 0);
+    for (int i = 0; i < STATS_MAX_SHARDS; i++) {
+        if (__atomic_load_n(&stats_shared->shards[i].in_use, __ATOMIC_ACQUIRE)) {
+            stats_merge(total, &stats_shared->shards[i], 0);
+        }
+    }
+
+    long uptime = (long)(time(NULL) - stats_shared->started);
+    if (format == 2) {
+        fprintf(out, "# TYPE httpd_uptime_seconds gauge\nhttpd_uptime_seconds %ld\n", uptime);
+        for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+            if (i >= STATS_STATUS_1XX) {
+                if (i == STATS_STATUS_1XX) {
+                    fprintf(out, "# TYPE httpd_responses_total counter\n");
+                }
+                fprintf(out, "httpd_responses_total{code=\"%dxx\"} %llu\n", i - STATS_STATUS_1XX + 1,
+                        (unsigned long long)total->counters[i]);
+            } else {
+                fprintf(out, "# TYPE httpd_%s_total counter\nhttpd_%s_total %llu\n", stats_counter_names[i],
+                        stats_counter_names[i], (unsigned long long)total->counters[i]);
+            }
+        }
+        fprintf(out, "# TYPE httpd_stage_seconds summary\n");
+        for (int i = 0; i < STATS_NUM_STAGES; i++) {
+            const stats_histogram *h = &total->stages[i];
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                fprintf(out, "httpd_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.9f\n", stats_stage_names[i],
+                        quantiles[q] / 100, h->total ? stats_percentile(h, quantiles[q]) / 1e9 : 0.0);
+            }
+            fprintf(out, "httpd_stage_seconds_sum{stage=\"%s\"} %.9f\n", stats_stage_names[i], h->sum / 1e9);
+            fprintf(out, "httpd_stage_seconds_count{stage=\"%s\"} %llu\n", stats_stage_names[i],
+                    (unsigned long long)h->total);
+        }
+    } else {
+        fprintf(out, "uptime_seconds %ld\n", uptime);
+        for (int i = 0; i < STATS_NUM_COUNTERS; i++) {
+            fprintf(out, "%s %llu\n", stats_counter_names[i], (unsigned long long)total->counters[i]);
+        }
+        fprintf(out, "\n%-10s %10s %10s %10s %10s %10s %10s  (microseconds)\n",
+                "stage", "count", "p50", "p90", "p99", "p99.9", "max");
+        for (int i = 0; i < STATS_NUM_STAGES; i++) {
+            const stats_histogram *h = &total->stages[i];
+            fprintf(out, "%-10s %10llu", stats_stage_names[i], (unsigned long long)h->total);
+            for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+                fprintf(out, " %10.1f", h->total ? stats_percentile(h, quantiles[q]) / 1e3 : 0.0);
+            }
+            fprintf(out, " %10.1f\n", h->max / 1e3);
+        }
+    }
+    fclose(out);
+    free(total);
+    return body;
+}
+
+#endif
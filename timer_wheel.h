@@ -0,0 +1,152 @@
+/* timer_wheel.h
+ * Hierarchical timing wheel for the connection timeouts of the event loop
+ * in server4.c.
+ *
+ * Time is counted in ticks. Level 0 has a slot per tick for the next
+ * WHEEL_SLOTS ticks; each level above covers WHEEL_SLOTS times the span of
+ * the one below. A timer is filed at the lowest level whose span still
+ * reaches its expiry, and when a higher slot comes due its timers are
+ * cascaded down to finer slots. Scheduling, rescheduling and cancelling
+ * are O(1) list operations on a node embedded in the connection, so a
+ * timeout costs no allocation and no timer syscall; the loop only has to
+ * call wheel_expire() every tick. Timers further out than WHEEL_LEVELS
+ * levels reach are parked in the last slot and filed again when it comes
+ * due, so they are never fired early.
+ *
+ * A wheel belongs to a single thread and takes no locks.
+ */
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4  // 2^24 ticks before timers are parked
+
+typedef struct wheel_timer {
+    struct wheel_timer *next;
+    struct wheel_timer **pprev;  // link pointing at this timer, or NULL when not scheduled
+    uint64_t expires;            // tick
+} wheel_timer;
+
+typedef struct {
+    uint64_t now;  // last tick processed
+    wheel_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    wheel_timer *expired;  // due, waiting to be handed out by wheel_expire()
+    size_t count;          // scheduled timers, expired ones included
+} timer_wheel;
+
+static inline void wheel_init(timer_wheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    w->now = now;
+}
+
+static inline void wheel_timer_init(wheel_timer *t) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+}
+
+static inline int wheel_pending(const wheel_timer *t) {
+    return t->pprev != NULL;
+}
+
+static inline void wheel_link(wheel_timer **head, wheel_timer *t) {
+    t->next = *head;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+}
+
+static inline void wheel_unlink(wheel_timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+// Files a timer by its expiry relative to w->now. The level is the lowest
+// one above which expiry and now agree, so its slot there lies ahead of the
+// current one and comes due before the expiry.
+static inline void wheel_file(timer_wheel *w, wheel_timer *t) {
+    if (t->expires <= w->now) {
+        wheel_link(&w->expired, t);
+        return;
+    }
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = (level + 1) * WHEEL_BITS;
+        if ((t->expires >> shift) == (w->now >> shift)) {
+            wheel_link(&w->slots[level][(t->expires >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1)], t);
+            return;
+        }
+    }
+    // Out of reach: park in the top slot that comes due last
+    int shift = (WHEEL_LEVELS - 1) * WHEEL_BITS;
+    wheel_link(&w->slots[WHEEL_LEVELS - 1][((w->now >> shift) - 1) & (WHEEL_SLOTS - 1)], t);
+}
+
+// (Re)schedules a timer to expire at tick expires; earlier ticks are due at once.
+static inline void wheel_schedule(timer_wheel *w, wheel_timer *t, uint64_t expires) {
+    if (wheel_pending(t)) {
+        wheel_unlink(t);
+    } else {
+        w->count++;
+    }
+    t->expires = expires;
+    wheel_file(w, t);
+}
+
+static inline void wheel_cancel(timer_wheel *w, wheel_timer *t) {
+    if (wheel_pending(t)) {
+        wheel_unlink(t);
+        w->count--;
+    }
+}
+
+// Moves every timer of a slot back through wheel_file(): due ones to the
+// expired list, the rest to finer slots.
+static inline void wheel_cascade(timer_wheel *w, wheel_timer **slot) {
+    wheel_timer *t = *slot;
+    *slot = NULL;
+    while (t != NULL) {
+        wheel_timer *next = t->next;
+        wheel_file(w, t);
+        t = next;
+    }
+}
+
+/* Advances the wheel to tick now and returns one timer that is due, no
+ * longer scheduled, or NULL when none is left. Call it until it returns
+ * NULL; handling a timer may schedule or cancel others meanwhile. */
+static inline wheel_timer *wheel_expire(timer_wheel *w, uint64_t now) {
+    while (w->expired == NULL && w->now < now) {
+        if (w->count == 0) {
+            w->now = now;  // nothing to find on the way
+            break;
+        }
+        w->now++;
+        // Higher levels first, so their timers can land in the slot of this tick
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = level * WHEEL_BITS;
+            if ((w->now & (((uint64_t)1 << shift) - 1)) == 0) {
+                wheel_cascade(w, &w->slots[level][(w->now >> shift) & (WHEEL_SLOTS - 1)]);
+            }
+        }
+        wheel_cascade(w, &w->slots[0][w->now & (WHEEL_SLOTS - 1)]);
+    }
+    wheel_timer *t = w->expired;
+    if (t != NULL) {
+        wheel_unlink(t);
+        w->count--;
+    }
+    return t;
+}
+
+#endif